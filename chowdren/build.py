@@ -1,34 +1,97 @@
 import os
+import math
+import time
 import shutil
+import hashlib
+import json
 from cStringIO import StringIO
-from chowdren.common import to_c, repr_c, copy_tree, make_color, to_cap_words
-from chowdren.image import Image
-import subprocess
+from chowdren.common import (to_c, repr_c, copy_tree, copy_file, make_color,
+    to_cap_words)
+from chowdren.image import Image, HASH_VERSION
+from chowdren.font import Font, bake_font, get_characters, BAKE_VERSION
+from chowdren.object import MOVEMENT_TYPES
+from chowdren.events import EventCompiler
+from chowdren.driver import BuildDriver
 
 RUNTIME_DIR = os.path.join(os.getcwd(), 'runtime')
 
-def get_cmake_path(path):
-    return path.replace('\\', '/')
-
-BASE_COMPILER_PATH = os.getcwd()
-MINGW_DIR = os.path.join(BASE_COMPILER_PATH, 'mingw', 'bin')
-MINGW_C_COMPILER = os.path.join(MINGW_DIR, 'gcc.exe')
-MINGW_CXX_COMPILER = os.path.join(MINGW_DIR, 'g++.exe')
-MINGW_MAKE = os.path.join(MINGW_DIR, 'mingw32-make.exe')
-CMAKE_EXE = os.path.join(BASE_COMPILER_PATH, 'cmake', 'bin', 'cmake.exe')
-CMAKE_ARGS = [CMAKE_EXE, '-G', 'MinGW Makefiles', '..', 
-    '-DCMAKE_CXX_COMPILER=%s' % get_cmake_path(MINGW_CXX_COMPILER),
-    '-DCMAKE_C_COMPILER=%s' % get_cmake_path(MINGW_C_COMPILER)
-]
-EXE_FILENAME = 'Chowdren.exe'
+MANIFEST_FILENAME = 'manifest.json'
+
+def get_hash(data):
+    return hashlib.md5(data).hexdigest()
+
+class BuildManifest(object):
+    """
+    Records a content hash for every file the builder generates, so files
+    whose content did not change are left alone and keep their timestamps.
+    Outputs from the previous build that were not generated again are
+    removed on save(). Files can also carry data derived while writing them
+    (like the trim box of an image), kept as long as the file is current.
+    """
+    def __init__(self, outdir):
+        self.outdir = outdir
+        self.filename = os.path.join(outdir, MANIFEST_FILENAME)
+        try:
+            with open(self.filename, 'rb') as fp:
+                manifest = json.load(fp)
+            self.old = manifest['files']
+            self.old_data = manifest.get('data', {})
+        except (IOError, ValueError, KeyError):
+            self.old = {}
+            self.old_data = {}
+        self.files = {}
+        self.data = {}
+        self.written = []
+
+    def get_key(self, filename):
+        return os.path.relpath(filename, self.outdir).replace('\\', '/')
+
+    def is_current(self, filename, digest):
+        key = self.get_key(filename)
+        if self.old.get(key, None) != digest or not os.path.isfile(filename):
+            return False
+        self.files[key] = digest
+        return True
+
+    def add(self, filename, digest):
+        key = self.get_key(filename)
+        self.files[key] = digest
+        self.written.append(key)
+
+    def get_data(self, filename):
+        return self.old_data.get(self.get_key(filename), None)
+
+    def set_data(self, filename, value):
+        self.data[self.get_key(filename)] = value
+
+    def write(self, filename, data):
+        # returns True if the file had to be written
+        digest = get_hash(data)
+        if self.is_current(filename, digest):
+            return False
+        with open(filename, 'wb') as fp:
+            fp.write(data)
+        self.add(filename, digest)
+        return True
+
+    def save(self):
+        for key in self.old:
+            if key in self.files:
+                continue
+            filename = os.path.join(self.outdir, key)
+            if os.path.isfile(filename):
+                os.remove(filename)
+        with open(self.filename, 'wb') as fp:
+            json.dump({'files' : self.files, 'data' : self.data}, fp,
+                      indent = 1, sort_keys = True)
 
 class CodeWriter(object):
     indentation = 0
-    def __init__(self, filename = None):
-        if filename is None:
-            self.fp = StringIO()
-        else:
-            self.fp = open(filename, 'wb+')
+    def __init__(self, filename = None, manifest = None):
+        # files are only written on close(), and only if they changed
+        self.filename = filename
+        self.manifest = manifest
+        self.fp = StringIO()
     
     def format_line(self, line):
         return self.get_spaces() + line
@@ -132,122 +195,280 @@ class CodeWriter(object):
         return (self.indentation + extra) * '    '
     
     def close(self):
+        if self.filename is not None:
+            data = self.fp.getvalue()
+            if self.manifest is not None:
+                self.manifest.write(self.filename, data)
+            else:
+                with open(self.filename, 'wb') as fp:
+                    fp.write(data)
         self.fp.close()
 
-def get_image(image):
-    return 'image%s' % image.id
-
-def convert_class_parameter(value):
-    if isinstance(value, Image):
-        return '&' + get_image(value)
-    else:
-        return str(value)
-
 class Builder(object):
     def __init__(self, project, outdir):
         self.project = project
         self.data = data = project.data
         self.outdir = outdir
+        self.manifest = BuildManifest(outdir)
+        # including the ones no open scene uses, along with their images
+        project.load_object_types()
+        # unchanged runtime files keep their timestamps
         copy_tree(os.path.join(os.getcwd(), RUNTIME_DIR), outdir)
 
+        # every scene and object type is written to its own .cpp file, so
+        # they compile in parallel and only the changed ones are rebuilt.
+        # sources.cmake lists them for CMakeLists.txt
+        self.sources = []
+
         # config.h
         config = self.open_code('config.h')
-
-        includes = ['common.h']
-        scene_classes = []
-        for i in xrange(len(data.scenes)):
-            includes.append('scene%s.h' % (i+1))
-            scene_classes.append('Scene%s' % (i+1))
-        config.put_includes(*includes)
+        config.put_includes('common.h')
 
         config.put_define('WINDOW_WIDTH', 800)
         config.put_define('WINDOW_HEIGHT', 600)
         config.put_define('NAME', repr_c(data.name))
+        config.put_newline()
+
+        scene_count = len(data.scenes)
+        for i in xrange(scene_count):
+            config.put_line('Scene * create_scene%s(GameManager * manager);'
+                % (i+1))
+        config.put_newline()
 
         config.put_line('static Scene ** scenes = NULL;')
         config.put_func('Scene ** get_scenes', 'GameManager * manager')
         config.put_line('if (scenes) return scenes;')
-        config.put_line('scenes = new Scene*[%s];' % len(scene_classes))
-        for i, scene in enumerate(scene_classes):
-            config.put_line('scenes[%s] = new %s(manager);' % (i, scene))
+        config.put_line('scenes = new Scene*[%s];' % scene_count)
+        for i in xrange(scene_count):
+            config.put_line('scenes[%s] = create_scene%s(manager);' % (i,
+                i+1))
         config.put_line('return scenes;')
         config.end_brace()
         config.close()
 
         # images.h
         images = self.open_code('images.h')
-        images.put_includes('common.h')
         images.start_guard('IMAGES_H')
-
-        for image_id, image in project.images.iteritems():
-            image.save(self.get_filename('images', '%s.png' % image_id))
-            image_name = get_image(image)
-            images.put_line(to_c(
-                'static Image %s(%r, %s, %s);',
+        images.put_includes('common.h')
+        image_definitions = self.open_source('images.cpp')
+        image_definitions.put_includes('images.h')
+
+        # identical bitmaps with the same hotspot share one runtime Image,
+        # and so one texture
+        self.image_names = {}
+        unique_images = {}
+        for image_id, image in sorted(project.images.iteritems()):
+            digest = image.get_hash()
+            key = (digest, image.hotspot_x, image.hotspot_y)
+            if key in unique_images:
+                self.image_names[image_id] = unique_images[key]
+                continue
+            image_name = 'image%s' % image_id
+            unique_images[key] = self.image_names[image_id] = image_name
+            filename = self.get_filename('images', '%s.png' % image_id)
+            # transparent borders are cut off, and the runtime offsets the
+            # quad by the trim box. the box is only reused if it was
+            # computed for the same pixel hash, alpha included
+            cached = self.manifest.get_data(filename)
+            if (isinstance(cached, dict) and
+                    cached.get('hash') == [HASH_VERSION, digest] and
+                    self.manifest.is_current(filename, digest)):
+                trim = tuple(cached['trim'])
+            else:
+                trim = image.get_trim_box()
+                image.save_trimmed(filename, trim)
+                self.manifest.add(filename, digest)
+            self.manifest.set_data(filename, {'hash' : [HASH_VERSION, digest],
+                                              'trim' : list(trim)})
+            images.put_line('extern Image %s;' % image_name)
+            image_definitions.put_line(to_c(
+                'Image %s(%r, %s, %s, %s, %s, %s, %s, %s, %s);',
                 image_name, str(image_id), image.hotspot_x, 
-                image.hotspot_y))
+                image.hotspot_y, *trim))
         
         images.close_guard('IMAGES_H')
         images.close()
+        image_definitions.close()
+
+        # fonts.h
+        self.write_fonts()
 
         # objects.h
         self.object_type_names = {}
         objects = self.open_code('objects.h')
-        objects.put_includes('common.h', 'images.h')
+        objects.start_guard('OBJECTS_H')
+        objects.put_includes('common.h')
         for type_id, object_type in project.object_types.iteritems():
             self.write_object_type(type_id, object_type, objects)
+        self.write_groups(objects)
+        objects.close_guard('OBJECTS_H')
         objects.close()
 
         # object type implementations
         type_files = set()
         for type_id, object_type in project.object_types.iteritems():
             type_files.add(object_type.get_runtime())
+            for src, dst in object_type.get_runtime_files():
+                dst = self.get_filename(dst)
+                self.make_directory(os.path.dirname(dst))
+                copy_file(src, dst)
 
         type_includes = set()
+        runtime_sources = set()
+        for object_type in project.object_types.itervalues():
+            runtime_sources.update(object_type.runtime_sources)
         for name, path in type_files:
             ext = os.path.splitext(path)[1]
             name = '%s%s' % (name, ext)
             new_path = self.get_filename('objects', name)
-            shutil.copyfile(path, new_path)
+            copy_file(path, new_path)
             type_includes.add('objects/%s' % name)
 
         types = self.open_code('objecttypes.h')
-        types.put_includes(*type_includes)
+        types.put_includes(*sorted(type_includes))
         types.close()
 
         # scenes
-        for scene in data.scenes:
-            self.write_scene(scene)
-
-    def write_scene(self, data):
-        index = self.data.scenes.index(data)
+        for index in xrange(len(data.scenes)):
+            self.write_scene(index, project.read_scene(index))
+
+        # sources.cmake
+        sources = sorted(runtime_sources) + self.sources
+        cmake = self.open_code('sources.cmake')
+        cmake.put_line('set(GENERATED_SOURCES')
+        cmake.indent()
+        for name in sources:
+            cmake.put_line(name)
+        cmake.dedent()
+        cmake.put_line(')')
+        cmake.close()
+
+        # unity.cpp, used instead of the separate files with CHOWDREN_UNITY
+        unity = self.open_code('unity.cpp')
+        unity.put_includes('run.cpp', *sources)
+        unity.close()
+
+        self.manifest.save()
+
+    def write_fonts(self):
+        # bake every font/size pair used by an object type into an atlas
+        # with the characters from its text plus the configured ranges
+        used = {}
+        for object_type in self.project.object_types.itervalues():
+            for font, text in object_type.get_fonts():
+                used.setdefault(font.get_key(), []).append(text)
+
+        self.font_names = {}
+        fonts = self.open_code('fonts.h')
+        fonts.start_guard('FONTS_H')
+        fonts.put_includes('common.h')
+        font_definitions = self.open_source('fonts.cpp')
+        font_definitions.put_includes('fonts.h')
+        if used:
+            self.make_directory('fonts')
+        for index, key in enumerate(sorted(used)):
+            filename, size = key
+            characters = get_characters(used[key], self.data.font_ranges)
+            # baking is skipped if the font file, size and characters are
+            # the same as last time
+            digest = get_hash(repr((BAKE_VERSION, filename,
+                os.path.getmtime(filename), size, sorted(characters))))
+            atlas_file = self.get_filename('fonts', '%s.png' % index)
+            metrics_file = self.get_filename('fonts', '%s.dat' % index)
+            if not (self.manifest.is_current(atlas_file, digest) and
+                    self.manifest.is_current(metrics_file, digest)):
+                atlas, metrics = bake_font(filename, size, characters)
+                atlas.save(atlas_file)
+                with open(metrics_file, 'wb') as fp:
+                    fp.write(metrics)
+                self.manifest.add(atlas_file, digest)
+                self.manifest.add(metrics_file, digest)
+            font_name = 'font%s' % index
+            self.font_names[key] = font_name
+            fonts.put_line('extern BakedFont %s;' % font_name)
+            font_definitions.put_line(to_c('BakedFont %s(%r);', font_name,
+                str(index)))
+        fonts.close_guard('FONTS_H')
+        fonts.close()
+        font_definitions.close()
+
+    def write_groups(self, objects):
+        self.group_names = {}
+        for index, name in enumerate(sorted(self.data.groups)):
+            self.group_names[name] = index
+            types = [str(type_id) for type_id in self.data.groups[name]
+                     if type_id in self.project.object_types]
+            group_name = 'group%s' % index
+            objects.put_line('// %s' % name)
+            if types:
+                objects.put_line('static const int %s_types[] = {%s};' % (
+                    group_name, ', '.join(types)))
+                types_name = '%s_types' % group_name
+            else:
+                types_name = 'NULL'
+            objects.put_line('static const ObjectGroup %s = {%s, %s};' % (
+                group_name, types_name, len(types)))
+            objects.put_newline()
+
+    def convert_class_parameter(self, value):
+        if isinstance(value, Image):
+            return '&' + self.image_names[value.id]
+        elif isinstance(value, Font):
+            return '&' + self.font_names[value.get_key()]
+        else:
+            return str(value)
 
-        scene = self.open_code('scene%s.h' % (index+1))
+    def write_scene(self, index, data):
+        scene = self.open_source('scene%s.cpp' % (index+1))
         scene.put_includes('common.h', 'objects.h')
 
         class_name = 'Scene%s' % (index+1)
         scene.put_class(class_name, 'Scene')
 
+        events = None
+        if data.events:
+            events = EventCompiler(self, data)
+
         scene.put_access('public')
         scene.put_line(to_c('%s(GameManager * manager) : '
             'Scene(%r, %s, %s, %s, %s, manager)',
             class_name, data.name, data.width, data.height, 
             make_color(data.background), index))
         scene.start_brace()
+        if events is not None:
+            events.write_constructor(scene)
         scene.end_brace()
 
         scene.put_func('void on_start')
+        for layer in data.batch_layers:
+            scene.put_line('set_layer_batching(%s, true);' % layer)
         for instance in data.instances:
-            scene.put_line('add_object(new %s(%s, %s));' %
-                (self.object_type_names[instance.object_type], instance.x, 
-                instance.y))
+            new_object = 'new %s(%s, %s)' % (
+                self.object_type_names[instance.object_type], instance.x,
+                instance.y)
+            if instance.layer == 0 and instance.z == 0:
+                scene.put_line('add_object(%s);' % new_object)
+            else:
+                scene.put_line('add_object(%s, %s, %s);' % (new_object,
+                    instance.layer, instance.z))
         scene.end_brace()
 
+        if events is not None:
+            events.write(scene)
+
         scene.end_brace(True)
+        scene.put_newline()
+
+        scene.put_func('Scene * create_scene%s' % (index+1),
+                       'GameManager * manager')
+        scene.put_line('return new %s(manager);' % class_name)
+        scene.end_brace()
 
         scene.close()
 
     def write_object_type(self, type_id, object_type, objects):
+        # the class goes in objects.h, its constant tables and constructor
+        # in objectN.cpp
         # XXX put object name here instead of class name
         name = object_type.get_class_name()
         subclass = object_type.get_class_name()
@@ -256,23 +477,74 @@ class Builder(object):
         objects.put_class(class_name, subclass)
         objects.put_access('public')
         objects.put_line('static const int type_id = %s;' % type_id)
+        objects.put_line('%s(int x, int y);' % class_name)
+        objects.end_brace(True)
+        objects.put_newline()
+
+        source = self.open_source('object%s.cpp' % type_id)
+        source.put_includes('common.h', 'images.h', 'fonts.h', 'objects.h')
+        object_type.write_tables(source, self)
+        movement = self.write_movement(type_id, object_type, source)
         parameters = [to_c('%r', name), 'x', 'y', 'type_id']
-        extra_parameters = [convert_class_parameter(item) 
+        extra_parameters = [self.convert_class_parameter(item) 
             for item in object_type.get_parameters()]
         parameters = ', '.join(extra_parameters + parameters)
         init_list = [to_c('%s(%s)', subclass, parameters)]
         for name, value in object_type.get_init_list():
             init_list.append(to_c('%s(%r)', name, value))
         init_list = ', '.join(init_list)
-        objects.put_line(to_c('%s(int x, int y) : %s', class_name, 
-            init_list))
-        objects.start_brace()
-        object_type.write_init(objects)
-        objects.end_brace()
-        objects.end_brace(True)
+        source.put_line(to_c('%s::%s(int x, int y) : %s', class_name,
+            class_name, init_list))
+        source.start_brace()
+        if movement is not None:
+            source.put_line('movement = &%s;' % movement)
+        object_type.write_init(source)
+        source.end_brace()
+        source.close()
+
+    def write_movement(self, type_id, object_type, objects):
+        movement = object_type.movement
+        if not movement:
+            return None
+        name = 'movement%s' % type_id
+        kind = MOVEMENT_TYPES.index(movement['type'])
+        nodes = movement.get('nodes', [])
+        nodes_name = 'NULL'
+        path_length = 0.0
+        if nodes:
+            nodes_name = name + '_nodes'
+            objects.put_line('static const PathNode %s[] = {%s};' % (
+                nodes_name, ', '.join(['{%s, %s}' % (float(x), float(y))
+                                       for (x, y) in nodes])))
+            last_x = last_y = 0.0
+            for x, y in nodes:
+                path_length += math.hypot(x - last_x, y - last_y)
+                last_x, last_y = x, y
+        objects.put_line(to_c(
+            'static const MovementInfo %s = {%s, %s, %s, %s, %s, %s, %s, %s};',
+            name, kind, float(movement.get('speed', 0)),
+            float(movement.get('angle', 0)), movement.get('bounce', True),
+            nodes_name, len(nodes), movement.get('loop', False),
+            path_length))
+        objects.put_newline()
+        return name
 
     def open_code(self, *path):
-        return CodeWriter(self.get_filename(*path))
+        return CodeWriter(self.get_filename(*path), self.manifest)
+
+    def open_source(self, *path):
+        # a generated translation unit, listed in sources.cmake
+        self.sources.append('/'.join(path))
+        return self.open_code(*path)
+
+    def create_writer(self):
+        return CodeWriter()
+
+    def make_directory(self, *path):
+        try:
+            os.makedirs(self.get_filename(*path))
+        except OSError:
+            pass
 
     def open(self, *path):
         return open(self.get_filename(*path), 'wb')
@@ -280,35 +552,11 @@ class Builder(object):
     def get_filename(self, *path):
         return os.path.join(self.outdir, *path)
 
-def build(data, out):
-    # shutil.rmtree(outdir, ignore_errors = True)
+def build(data, out, configurations = ('Release',), mode = 'pch',
+          session = None):
+    start = time.time()
     Builder(data, out)
-
-    build_directory = os.path.join(out, 'build')
-
-    # use cmake to make mingw makefiles
-    process = subprocess.Popen(CMAKE_ARGS, cwd = build_directory)
-
-    while 1:
-        ret = process.poll()
-        if ret is None:
-            yield
-            continue
-        elif ret != 0:
-            return
-        break
-
-    # use mingw to build executable
-    process = subprocess.Popen([MINGW_MAKE], cwd = build_directory)
-
-    while 1:
-        ret = process.poll()
-        if ret is None:
-            yield
-            continue
-        elif ret != 0:
-            return
-        break
-
-    subprocess.Popen([os.path.join(build_directory, EXE_FILENAME)],
-        cwd = out)
\ No newline at end of file
+    driver = BuildDriver(out, configurations, mode, session)
+    driver.output('generated in %.1fs' % (time.time() - start))
+    driver.start()
+    return driver
@@ -31,6 +31,20 @@ def to_c(format_spec, *args):
 def repr_c(value):
     return to_c('%r', value)
 
+def copy_file(src, dst):
+    # skips files with the same size and modification time, so unchanged
+    # files keep their timestamps and are not rebuilt
+    try:
+        src_stat = os.stat(src)
+        dst_stat = os.stat(dst)
+        if (src_stat.st_size == dst_stat.st_size and
+                int(src_stat.st_mtime) == int(dst_stat.st_mtime)):
+            return False
+    except OSError:
+        pass
+    shutil.copy2(src, dst)
+    return True
+
 def copy_tree(src, dst):
     names = os.listdir(src)
     try:
@@ -45,7 +59,7 @@ def copy_tree(src, dst):
             if os.path.isdir(srcname):
                 copy_tree(srcname, dstname)
             else:
-                shutil.copy2(srcname, dstname)
+                copy_file(srcname, dstname)
         # catch the Error from the recursive copytree so that we can
         # continue with other files
         except shutil.Error, err:
@@ -90,18 +104,51 @@ def check_leading_digits(value, prefix):
     return value
 
 class IDPool(object):
+    """
+    Ids that were given back are reused before new ones are handed out, so
+    the runtime tables indexed by them stay dense. Given-back ids below the
+    high-water mark are kept on a free list, which makes pop() and
+    put_back() O(1) amortized.
+    """
+
     def __init__(self):
-        self.taken = set()
+        self.next_id = 0
+        # ids below next_id that are not taken. the stack may hold stale
+        # entries for ids that were reserved with pop(existing) since
+        self.free = set()
+        self.free_stack = []
 
     def pop(self, existing = None):
         if existing is not None:
-            self.taken.add(existing)
+            self.reserve(existing)
             return existing
-        value = 0
-        while value in self.taken:
-            value += 1
-        self.taken.add(value)
+        while self.free_stack:
+            value = self.free_stack.pop()
+            if value in self.free:
+                self.free.discard(value)
+                return value
+        value = self.next_id
+        self.next_id += 1
         return value
 
+    def reserve(self, value):
+        if value < self.next_id:
+            self.free.discard(value)
+            return
+        # ids skipped over become free
+        for skipped in xrange(self.next_id, value):
+            self.free.add(skipped)
+            self.free_stack.append(skipped)
+        self.next_id = value + 1
+
+    def is_taken(self, value):
+        return value < self.next_id and value not in self.free
+
     def put_back(self, value):
-        self.taken.discard(value)
\ No newline at end of file
+        if not self.is_taken(value):
+            return
+        if value == self.next_id - 1:
+            self.next_id -= 1
+            return
+        self.free.add(value)
+        self.free_stack.append(value)
@@ -1,6 +1,116 @@
 # Copyright (c) Mathias Kaerlev
 # See LICENSE for details.
 
+import os
+import sys
+import json
+import struct
+from array import array
+
+# Project files start with a magic, the format version and the offset of an
+# index, followed by one block per scene and one for the application data.
+# The index gives the name and block of every scene, so a scene is only
+# parsed when it is first accessed. Instances are stored as packed integers
+# rather than a dict each, everything else is JSON, so opening a project
+# never runs code from it. application.py files written with repr() by
+# older versions are still read.
+
+PROJECT_MAGIC = 'CHOWPROJ'
+PROJECT_VERSION = 2
+PROJECT_HEADER = struct.Struct('<8sIQ')
+BLOCK_SIZE = struct.Struct('<I')
+
+# JSON only has lists and string keys, so tuples and dicts with other keys
+# are tagged
+TUPLE_TAG = '__tuple__'
+ITEMS_TAG = '__items__'
+
+# packed per instance, in this order
+INSTANCE_FIELDS = ('x', 'y', 'object_type', 'layer', 'z')
+
+def pack_ints(values):
+    values = array('i', values)
+    if sys.byteorder == 'big':
+        values.byteswap()
+    return values.tostring()
+
+def unpack_ints(data):
+    values = array('i')
+    values.fromstring(data)
+    if sys.byteorder == 'big':
+        values.byteswap()
+    return values
+
+def to_json(value):
+    if isinstance(value, tuple):
+        return {TUPLE_TAG : [to_json(item) for item in value]}
+    if isinstance(value, list):
+        return [to_json(item) for item in value]
+    if isinstance(value, dict):
+        for k in value:
+            if not isinstance(k, basestring) or k in (TUPLE_TAG, ITEMS_TAG):
+                return {ITEMS_TAG : [[to_json(k), to_json(v)]
+                                     for k, v in value.iteritems()]}
+        return dict([(k, to_json(v)) for k, v in value.iteritems()])
+    return value
+
+def from_json(value):
+    if isinstance(value, unicode):
+        # the str the value most likely was, if it is ASCII
+        try:
+            return value.encode('ascii')
+        except UnicodeEncodeError:
+            return value
+    if isinstance(value, list):
+        return [from_json(item) for item in value]
+    if isinstance(value, dict):
+        if TUPLE_TAG in value:
+            return tuple([from_json(item) for item in value[TUPLE_TAG]])
+        if ITEMS_TAG in value:
+            return dict([(from_json(k), from_json(v))
+                         for k, v in value[ITEMS_TAG]])
+        return dict([(from_json(k), from_json(v))
+                     for k, v in value.iteritems()])
+    return value
+
+def dump_block(value):
+    return json.dumps(to_json(value), separators = (',', ':'))
+
+def load_block(data):
+    return from_json(json.loads(data))
+
+class ProjectReader(object):
+    def __init__(self, filename):
+        self.filename = filename
+        with open(filename, 'rb') as fp:
+            magic, version, index_offset = PROJECT_HEADER.unpack(
+                fp.read(PROJECT_HEADER.size))
+            if magic != PROJECT_MAGIC:
+                raise IOError('%s is not a project file' % filename)
+            if version > PROJECT_VERSION:
+                raise IOError('%s needs a newer version (format %s)' % (
+                    filename, version))
+            if version < PROJECT_VERSION:
+                raise IOError('%s uses an unsupported format (%s)' % (
+                    filename, version))
+            self.version = version
+            fp.seek(index_offset)
+            self.index = load_block(fp.read())
+
+    def read_block(self, block):
+        offset, size = block
+        with open(self.filename, 'rb') as fp:
+            fp.seek(offset)
+            return fp.read(size)
+
+def get_backup_file(filename):
+    # the previous save, kept by CodeData.save_file
+    return filename + '.bak'
+
+def is_project_file(filename):
+    with open(filename, 'rb') as fp:
+        return fp.read(len(PROJECT_MAGIC)) == PROJECT_MAGIC
+
 class BaseSerializer(object):
     def __init__(self, data = None):
         if data is None:
@@ -34,40 +144,142 @@ class ObjectType(BaseSerializer):
         self.name = 'Undefined'
         self.type_id = -1
         self.data = {}
+        self.movement = None
 
     def read(self, data):
         self.name = data['name']
         self.type_id = data['id']
         self.data = data.get('data', {})
+        self.movement = data.get('movement', None)
 
     def write(self, data):
         data['name'] = self.name
         data['id'] = self.type_id
         data['data'] = self.data
+        data['movement'] = self.movement
 
 class ObjectInstance(BaseSerializer):
+    def initialize(self):
+        self.layer = 0
+        self.z = 0
+
     def read(self, data):
         self.x = data['x']
         self.y = data['y']
         self.object_type = data['object_type']
+        self.layer = data.get('layer', 0)
+        self.z = data.get('z', 0)
 
     def write(self, data):
         data['x'] = self.x
         data['y'] = self.y
         data['object_type'] = self.object_type
+        data['layer'] = self.layer
+        data['z'] = self.z
+
+class Event(BaseSerializer):
+    # conditions and actions are dicts, see chowdren/events.py
+    def initialize(self):
+        self.conditions = []
+        self.actions = []
+
+    def read(self, data):
+        self.conditions = data['conditions']
+        self.actions = data['actions']
+
+    def write(self, data):
+        data['conditions'] = self.conditions
+        data['actions'] = self.actions
 
 class Scene(BaseSerializer):
+    # (ProjectReader, block) while the contents are not loaded yet
+    source = None
+
     def initialize(self):
         self.instances = []
+        self.events = []
+        # layers whose objects are grouped by type within the same z
+        self.batch_layers = []
+
+    @classmethod
+    def from_source(cls, reader, item):
+        scene = cls.__new__(cls)
+        scene.name = item['name']
+        scene.source = (reader, item['block'])
+        return scene
+
+    def is_loaded(self):
+        return self.source is None
+
+    def __getattr__(self, name):
+        # only called for attributes that are missing, i.e. the contents
+        # of a scene that has not been loaded yet
+        if name.startswith('__') or self.source is None:
+            raise AttributeError(name)
+        self.load()
+        return getattr(self, name)
+
+    def load(self):
+        if self.source is None:
+            return
+        reader, block = self.source
+        self.source = None
+        self.read_block(reader.read_block(block))
+
+    def copy(self):
+        scene = Scene.__new__(Scene)
+        scene.read_block(self.get_block())
+        return scene
+
+    def read_block(self, data):
+        size, = BLOCK_SIZE.unpack_from(data)
+        start = BLOCK_SIZE.size
+        header = load_block(data[start:start + size])
+        self.name = header['name']
+        self.width = header['width']
+        self.height = header['height']
+        self.background = header['background']
+        self.batch_layers = header['batch_layers']
+        self.events = [Event(item) for item in header['events']]
+        values = unpack_ints(data[start + size:])
+        field_count = len(INSTANCE_FIELDS)
+        self.instances = instances = []
+        for i in xrange(0, len(values), field_count):
+            instance = ObjectInstance()
+            (instance.x, instance.y, instance.object_type, instance.layer,
+             instance.z) = values[i:i + field_count]
+            instances.append(instance)
+
+    def get_block(self):
+        if self.source is not None:
+            # not loaded, so unchanged since it was read
+            reader, block = self.source
+            return reader.read_block(block)
+        header = {'name' : self.name,
+                  'width' : self.width,
+                  'height' : self.height,
+                  'background' : self.background,
+                  'batch_layers' : self.batch_layers,
+                  'events' : [item.get_dict() for item in self.events]}
+        header = dump_block(header)
+        values = []
+        for instance in self.instances:
+            values.extend((instance.x, instance.y, instance.object_type,
+                           instance.layer, instance.z))
+        return BLOCK_SIZE.pack(len(header)) + header + pack_ints(values)
 
     def read(self, data):
         self.name = data['name']
         self.width = data['width']
         self.height = data['height']
         self.background = data['background']
+        self.batch_layers = data.get('batch_layers', [])
         self.instances = []
         for item in data['instances']:
             self.instances.append(ObjectInstance(item))
+        self.events = []
+        for item in data.get('events', []):
+            self.events.append(Event(item))
 
     def write(self, data):
         data['name'] = self.name
@@ -75,17 +287,31 @@ class Scene(BaseSerializer):
         data['height'] = self.height
         data['instances'] = instances = []
         data['background'] = self.background
+        data['batch_layers'] = self.batch_layers
         for item in self.instances:
             instances.append(item.get_dict())
+        data['events'] = events = []
+        for item in self.events:
+            events.append(item.get_dict())
 
 class CodeData(BaseSerializer):
     def initialize(self):
         self.name = 'Application'
         self.scenes = []
         self.object_types = {}
+        self.font_ranges = [(0x20, 0x7F)]
+        # group name -> list of object type ids
+        self.groups = {}
+        # image id -> hash of its pixels, see ProjectManager.save_image
+        self.image_hashes = {}
+        self.image_hash_version = 0
 
     def read(self, data):
         self.name = data.get('name', 'Application')
+        self.font_ranges = data.get('font_ranges', [(0x20, 0x7F)])
+        self.groups = data.get('groups', {})
+        self.image_hashes = data.get('image_hashes', {})
+        self.image_hash_version = data.get('image_hash_version', 0)
         self.object_types = {}
         for k, v in data.get('object_types', {}).iteritems():
             self.object_types[k] = ObjectType(v)
@@ -93,11 +319,67 @@ class CodeData(BaseSerializer):
         for item in data.get('scenes', []):
             self.scenes.append(Scene(item))
 
-    def write(self, data):
+    @classmethod
+    def load_file(cls, filename):
+        if not is_project_file(filename):
+            with open(filename, 'rb') as fp:
+                return cls.load(fp)
+        reader = ProjectReader(filename)
+        data = cls(load_block(reader.read_block(
+            reader.index['application'])))
+        data.scenes = [Scene.from_source(reader, item)
+                       for item in reader.index['scenes']]
+        return data
+
+    def save_file(self, filename):
+        # written next to the old file first, since scenes that were never
+        # loaded are copied over from it
+        temp = filename + '.tmp'
+        index = {'scenes' : []}
+        with open(temp, 'wb') as fp:
+            fp.write(PROJECT_HEADER.pack(PROJECT_MAGIC, PROJECT_VERSION, 0))
+            for scene in self.scenes:
+                block = scene.get_block()
+                index['scenes'].append({'name' : scene.name,
+                                        'block' : (fp.tell(), len(block))})
+                fp.write(block)
+            application = {}
+            self.write_application(application)
+            block = dump_block(application)
+            index['application'] = (fp.tell(), len(block))
+            fp.write(block)
+            index_offset = fp.tell()
+            fp.write(dump_block(index))
+            fp.seek(0)
+            fp.write(PROJECT_HEADER.pack(PROJECT_MAGIC, PROJECT_VERSION,
+                index_offset))
+        # the old file is moved aside rather than removed, so there is
+        # always a complete project on disk, see get_backup_file
+        backup = get_backup_file(filename)
+        if os.path.isfile(filename):
+            if os.path.isfile(backup):
+                os.remove(backup)
+            os.rename(filename, backup)
+        os.rename(temp, filename)
+        # unloaded scenes now point into the new file
+        reader = ProjectReader(filename)
+        for scene, item in zip(self.scenes, index['scenes']):
+            if scene.is_loaded():
+                continue
+            scene.source = (reader, item['block'])
+
+    def write_application(self, data):
         data['name'] = self.name
-        data['scenes'] = scenes = []
-        for scene in self.scenes:
-            scenes.append(scene.get_dict())
+        data['font_ranges'] = self.font_ranges
+        data['groups'] = self.groups
+        data['image_hashes'] = self.image_hashes
+        data['image_hash_version'] = self.image_hash_version
         data['object_types'] = object_types = {}
         for k, v in self.object_types.iteritems():
-            object_types[k] = v.get_dict()
\ No newline at end of file
+            object_types[k] = v.get_dict()
+
+    def write(self, data):
+        self.write_application(data)
+        data['scenes'] = scenes = []
+        for scene in self.scenes:
+            scenes.append(scene.get_dict())
\ No newline at end of file
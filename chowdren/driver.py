@@ -0,0 +1,315 @@
+# Copyright (c) Mathias Kaerlev
+# See LICENSE for details.
+
+# Drives the native build of a generated project. Every configuration gets
+# its own CMake build directory and worker thread, so several of them can be
+# built at the same time. Compiler output is collected line by line into a
+# queue that the editor drains from its timer. Configure and build times are
+# appended to build/timings.json, so the build modes can be compared for
+# projects of different sizes.
+#
+# Given a session recorded with the runtime's -record option, the driver also
+# makes a profile-guided Release build: an instrumented build plays the
+# session back, then the same build directory is rebuilt with the profile.
+
+import os
+import sys
+import time
+import json
+import glob
+import shutil
+import subprocess
+import threading
+import multiprocessing
+from Queue import Queue, Empty
+from distutils.spawn import find_executable
+
+BASE_COMPILER_PATH = os.getcwd()
+MINGW_DIR = os.path.join(BASE_COMPILER_PATH, 'mingw', 'bin')
+BUNDLED_CMAKE = os.path.join(BASE_COMPILER_PATH, 'cmake', 'bin', 'cmake.exe')
+
+# see runtime/CMakeLists.txt
+CONFIGURATIONS = ('Debug', 'Release', 'Profile')
+
+# CMake options for each build mode, see runtime/CMakeLists.txt
+BUILD_MODES = {
+    'separate' : {'CHOWDREN_PCH' : 'OFF', 'CHOWDREN_UNITY' : 'OFF'},
+    'pch' : {'CHOWDREN_PCH' : 'ON', 'CHOWDREN_UNITY' : 'OFF'},
+    'unity' : {'CHOWDREN_PCH' : 'OFF', 'CHOWDREN_UNITY' : 'ON'}
+}
+
+TIMINGS_FILENAME = 'timings.json'
+
+if sys.platform == 'win32':
+    EXE_FILENAME = 'Chowdren.exe'
+else:
+    EXE_FILENAME = 'Chowdren'
+
+def get_cmake_path(path):
+    return path.replace('\\', '/')
+
+def get_cpu_count():
+    try:
+        return multiprocessing.cpu_count()
+    except NotImplementedError:
+        return 1
+
+class Toolchain(object):
+    cmake = generator = c_compiler = cxx_compiler = profdata = None
+
+    def __init__(self):
+        if sys.platform == 'win32' and os.path.isdir(MINGW_DIR):
+            self.detect_mingw()
+        else:
+            self.detect_host()
+
+    def detect_mingw(self):
+        # bundled compiler, as shipped with the Windows editor
+        self.cmake = BUNDLED_CMAKE
+        self.c_compiler = os.path.join(MINGW_DIR, 'gcc.exe')
+        self.cxx_compiler = os.path.join(MINGW_DIR, 'g++.exe')
+        if find_executable('ninja'):
+            self.generator = 'Ninja'
+        else:
+            self.generator = 'MinGW Makefiles'
+
+    def detect_host(self):
+        self.cmake = find_executable('cmake')
+        self.c_compiler = find_first(os.environ.get('CC'), 'gcc', 'clang')
+        self.cxx_compiler = find_first(os.environ.get('CXX'), 'g++',
+            'clang++')
+        if self.is_clang():
+            self.profdata = find_first('llvm-profdata')
+        if find_executable('ninja'):
+            self.generator = 'Ninja'
+        else:
+            self.generator = 'Unix Makefiles'
+
+    def is_clang(self):
+        return (self.cxx_compiler is not None and
+                'clang' in os.path.basename(self.cxx_compiler))
+
+    def get_missing(self):
+        if self.cmake is None or not os.path.isfile(self.cmake):
+            return 'cmake'
+        if self.cxx_compiler is None:
+            return 'C++ compiler'
+        return None
+
+    def get_configure_args(self, source, config, mode, definitions = None):
+        args = [self.cmake, '-G', self.generator, source,
+                '-DCMAKE_BUILD_TYPE=%s' % config]
+        options = BUILD_MODES[mode].copy()
+        options.update(definitions or {})
+        for name, value in sorted(options.iteritems()):
+            args.append('-D%s=%s' % (name, value))
+        if self.c_compiler is not None:
+            args.append('-DCMAKE_C_COMPILER=%s' % get_cmake_path(
+                self.c_compiler))
+        if self.cxx_compiler is not None:
+            args.append('-DCMAKE_CXX_COMPILER=%s' % get_cmake_path(
+                self.cxx_compiler))
+        return args
+
+    def get_build_args(self, jobs):
+        # both make and ninja take -j
+        return [self.cmake, '--build', '.', '--', '-j%s' % jobs]
+
+def get_source_count(out):
+    try:
+        lines = open(os.path.join(out, 'sources.cmake'), 'rb').readlines()
+    except IOError:
+        return 0
+    # minus the set( and ) lines
+    return max(0, len(lines) - 2)
+
+def find_first(*names):
+    for name in names:
+        if not name:
+            continue
+        path = find_executable(name)
+        if path is not None:
+            return path
+    return None
+
+def get_build_name(config, mode):
+    return '%s-%s' % (config.lower(), mode)
+
+def get_executable(out, config, mode):
+    return os.path.join(out, 'build', get_build_name(config, mode),
+        EXE_FILENAME)
+
+def record_session(out, session, config = 'Release', mode = 'pch'):
+    filename = get_executable(out, config, mode)
+    if not os.path.isfile(filename):
+        return None
+    return subprocess.Popen([filename, '-record', session], cwd = out)
+
+class BuildJob(threading.Thread):
+    success = False
+
+    def __init__(self, driver, config, jobs):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.driver = driver
+        self.config = config
+        self.jobs = jobs
+        self.build_name = get_build_name(config, driver.mode)
+        self.directory = os.path.join(driver.out, 'build', self.build_name)
+        self.configure_time = self.build_time = 0.0
+
+    def get_executable(self):
+        return os.path.join(self.directory, EXE_FILENAME)
+
+    def run(self):
+        if not os.path.isdir(self.directory):
+            os.makedirs(self.directory)
+        self.success = self.run_steps()
+        self.output('configure %.1fs, build %.1fs (%s mode)' % (
+            self.configure_time, self.build_time, self.driver.mode))
+        self.driver.add_timing(self)
+
+    def run_steps(self):
+        return self.configure() and self.build()
+
+    def configure(self, definitions = None):
+        start = time.time()
+        ok = self.run_command(self.driver.toolchain.get_configure_args(
+            self.driver.out, self.config, self.driver.mode, definitions))
+        self.configure_time += time.time() - start
+        return ok
+
+    def build(self):
+        start = time.time()
+        ok = self.run_command(self.driver.toolchain.get_build_args(
+            self.jobs))
+        self.build_time += time.time() - start
+        return ok
+
+    def run_command(self, args, cwd = None):
+        self.output(' '.join(args))
+        try:
+            process = subprocess.Popen(args, cwd = cwd or self.directory,
+                stdout = subprocess.PIPE, stderr = subprocess.STDOUT)
+        except OSError, e:
+            self.output('could not start %s: %s' % (args[0], e))
+            return False
+        for line in iter(process.stdout.readline, ''):
+            self.output(line.rstrip())
+        ret = process.wait()
+        if ret != 0:
+            self.output('%s failed with exit code %s' % (
+                os.path.basename(args[0]), ret))
+            return False
+        return True
+
+    def output(self, line):
+        self.driver.output('[%s] %s' % (self.config, line))
+
+class ProfileGuidedJob(BuildJob):
+    def __init__(self, driver, session, jobs):
+        BuildJob.__init__(self, driver, 'Release', jobs)
+        self.session = session
+        self.build_name += '-pgo'
+        self.directory = os.path.join(driver.out, 'build', self.build_name)
+        self.profile_directory = os.path.join(self.directory, 'profile')
+
+    def run_steps(self):
+        # stale profiles from an older build would be merged in
+        shutil.rmtree(self.profile_directory, ignore_errors = True)
+        definitions = {'CHOWDREN_PGO_DIR' :
+                       self.profile_directory.replace('\\', '/')}
+        definitions['CHOWDREN_PGO'] = 'generate'
+        if not self.configure(definitions) or not self.build():
+            return False
+        self.output('training run with %s' % self.session)
+        if not self.run_command([self.get_executable(), '-playback',
+                                 self.session], cwd = self.driver.out):
+            return False
+        toolchain = self.driver.toolchain
+        if toolchain.is_clang():
+            if toolchain.profdata is None:
+                self.output('could not find llvm-profdata')
+                return False
+            raw = glob.glob(os.path.join(self.profile_directory,
+                '*.profraw'))
+            if not self.run_command([toolchain.profdata, 'merge',
+                    '-output=%s' % os.path.join(self.profile_directory,
+                    'default.profdata')] + raw):
+                return False
+        definitions['CHOWDREN_PGO'] = 'use'
+        return self.configure(definitions) and self.build()
+
+class BuildDriver(object):
+    def __init__(self, out, configurations = CONFIGURATIONS, mode = 'pch',
+                 session = None, toolchain = None):
+        self.out = out
+        self.mode = mode
+        self.toolchain = toolchain or Toolchain()
+        self.queue = Queue()
+        self.timing_lock = threading.Lock()
+        # split the cores between the builds running at the same time
+        count = len(configurations)
+        if session is not None:
+            count += 1
+        jobs = max(1, get_cpu_count() / max(1, count))
+        self.jobs = [BuildJob(self, config, jobs)
+                     for config in configurations]
+        if session is not None:
+            self.jobs.append(ProfileGuidedJob(self, session, jobs))
+
+    def start(self):
+        missing = self.toolchain.get_missing()
+        if missing is not None:
+            self.output('could not find %s' % missing)
+            return
+        for job in self.jobs:
+            job.start()
+
+    def output(self, line):
+        self.queue.put(line)
+
+    def add_timing(self, job):
+        entry = {'time' : time.time(),
+                 'name' : job.build_name,
+                 'configuration' : job.config,
+                 'mode' : self.mode,
+                 'sources' : get_source_count(self.out),
+                 'configure' : job.configure_time,
+                 'build' : job.build_time,
+                 'success' : job.success}
+        filename = os.path.join(self.out, 'build', TIMINGS_FILENAME)
+        self.timing_lock.acquire()
+        try:
+            try:
+                timings = json.load(open(filename, 'rb'))
+            except (IOError, ValueError):
+                timings = []
+            timings.append(entry)
+            json.dump(timings, open(filename, 'wb'), indent = 4)
+        finally:
+            self.timing_lock.release()
+
+    def get_output(self):
+        lines = []
+        while 1:
+            try:
+                lines.append(self.queue.get_nowait())
+            except Empty:
+                return lines
+
+    def is_done(self):
+        for job in self.jobs:
+            if job.is_alive():
+                return False
+        return self.queue.empty()
+
+    def get_successful(self):
+        return [job for job in self.jobs if job.success]
+
+    def run(self, config = None):
+        for job in self.get_successful():
+            if config is not None and job.config != config:
+                continue
+            return subprocess.Popen([job.get_executable()], cwd = self.out)
+        return None
@@ -0,0 +1,558 @@
+# Copyright (c) Mathias Kaerlev
+# See LICENSE for details.
+
+# Compiles scene events into C++ member functions of the generated scene
+# class.
+#
+# An event is a list of conditions followed by a list of actions, each a dict
+# with 'name', 'parameters' and, for object conditions/actions, the
+# 'object_type' it works on. Conditions may also have 'negated' and
+# 'comparison' (one of COMPARISONS).
+#
+# Object conditions narrow down the instances of their type that the
+# following conditions and actions see. The narrowed down instances are kept
+# in a scratch ObjectList per type, a member of the scene that is filtered in
+# place and reused every tick. Types that no condition filters are used
+# straight from the scene's instance lists.
+#
+# Events with a trigger condition are not polled. They run from
+# handle_events() for every matching Trigger pushed to the scene's queue.
+# Object triggers fire when a watched object changes, with only that object
+# selected.
+#
+# Object conditions and actions may use a 'group' (see CodeData.groups)
+# instead of an 'object_type'. Groups are walked with a GroupIterator over
+# the per-type lists and only support the generic templates. Selecting from
+# a group does not change the selection of its member types.
+#
+# Loops are resolved to slots in Scene::loops at build time. 'start_loop'
+# becomes a for-loop calling the scene's loop_N() function, which runs the
+# events with an 'on_loop' condition for that loop.
+
+from chowdren.common import to_c
+
+# see TriggerType in runtime/common.h
+TRIGGER_TYPES = ('start_of_scene', 'key_pressed', 'key_released',
+                 'position_changed', 'value_changed')
+
+COMPARISONS = ('==', '!=', '<', '<=', '>', '>=')
+
+# C++ templates. {instance} is the object the condition/action is for, {0},
+# {1}, ... the compiled parameters and {comparison} the comparison operator.
+# object types add their own in ObjectBase.conditions/actions/expressions,
+# where {instance} is cast to the runtime class.
+
+CONDITIONS = {
+    'always' : 'true',
+    'never' : 'false',
+    'key_down' : 'is_key_down({0})',
+    'compare' : '{0} {comparison} {1}',
+    'chance' : 'randrange(100) < {0}'
+}
+
+OBJECT_CONDITIONS = {
+    'compare_x' : '{instance}->x {comparison} {0}',
+    'compare_y' : '{instance}->y {comparison} {0}',
+    'compare_z' : '{instance}->z {comparison} {0}',
+    'compare_layer' : '{instance}->layer {comparison} {0}'
+}
+
+# trigger condition -> (trigger type, index of the parameter matched against
+# the trigger parameter or None)
+TRIGGER_CONDITIONS = {
+    'start_of_scene' : ('start_of_scene', None),
+    'key_pressed' : ('key_pressed', 0),
+    'key_released' : ('key_released', 0)
+}
+
+# object trigger condition -> trigger type. the scene sets the trigger in
+# SceneObject::watch_mask for the types used with these
+OBJECT_TRIGGER_CONDITIONS = {
+    'on_position_changed' : 'position_changed',
+    'on_value_changed' : 'value_changed'
+}
+
+LOOP_NAMES = ('start_loop', 'stop_loop', 'on_loop', 'loop_index')
+
+OBJECT_ACTIONS = {
+    'set_x' : '{instance}->set_x({0})',
+    'set_y' : '{instance}->set_y({0})',
+    'set_position' : '{instance}->set_position({0}, {1})',
+    'move' : '{instance}->set_position({instance}->x + {0}, '
+             '{instance}->y + {1})',
+    'set_layer' : '{instance}->set_layer({0})',
+    'set_z' : '{instance}->set_z({0})'
+}
+
+OBJECT_EXPRESSIONS = {
+    'x' : '{instance}->x',
+    'y' : '{instance}->y',
+    'z' : '{instance}->z',
+    'layer' : '{instance}->layer'
+}
+
+EXPRESSIONS = {
+    'random' : 'randrange({0})',
+    'abs' : 'fabs({0})',
+    'min' : 'std::min<double>({0}, {1})',
+    'max' : 'std::max<double>({0}, {1})'
+}
+
+BINARY_OPERATORS = ('+', '-', '*', '/')
+
+def get_string(value):
+    if isinstance(value, unicode):
+        value = value.encode('utf-8')
+    value = value.replace('\\', '\\\\').replace('"', '\\"').replace(
+        '\n', '\\n')
+    return '"%s"' % value
+
+def get_key(name):
+    # GLFW uses uppercase ASCII for printable keys
+    if len(name) == 1:
+        return repr(name.upper())
+    return 'GLFW_KEY_%s' % name.upper()
+
+class EventCompiler(object):
+    def __init__(self, builder, scene):
+        self.builder = builder
+        self.scene = scene
+        self.project = builder.project
+        # scratch selection list members. every event has its own, so an
+        # event started from a loop cannot clobber the selection of the
+        # event running the loop
+        self.selections = []
+        # event function names per trigger type, with the matched parameter
+        self.triggered = {}
+        self.polled = []
+        self.loops = {}
+        self.get_loops(scene.events)
+        # (type id, trigger type) pairs to watch
+        self.watches = set()
+        for event in scene.events:
+            condition = self.get_object_trigger(event)
+            if condition is not None:
+                self.watches.add((condition['object_type'],
+                    OBJECT_TRIGGER_CONDITIONS[condition['name']]))
+        # event function names per loop slot
+        self.loop_events = [[] for name in self.loops]
+
+    def get_loops(self, value):
+        # loop name -> slot, in order of first use
+        if isinstance(value, dict):
+            if value.get('name', value.get('type', None)) in LOOP_NAMES:
+                name = value['parameters'][0]
+                if not isinstance(name, basestring):
+                    raise ValueError('loop names have to be constant')
+                self.loops.setdefault(name, len(self.loops))
+            for item in value.itervalues():
+                self.get_loops(item)
+        elif isinstance(value, (list, tuple)):
+            for item in value:
+                self.get_loops(item)
+        elif hasattr(value, 'conditions'):
+            self.get_loops(value.conditions)
+            self.get_loops(value.actions)
+
+    def get_loop(self, data):
+        return self.loops[data['parameters'][0]]
+
+    def get_object_trigger(self, event):
+        for condition in event.conditions:
+            if condition['name'] in OBJECT_TRIGGER_CONDITIONS:
+                return condition
+        return None
+
+    def write_constructor(self, writer):
+        for type_id, trigger_type in sorted(self.watches):
+            writer.put_line('watch(%s, %s);' % (type_id,
+                self.get_trigger_name(trigger_type)))
+        if not self.loops:
+            return
+        writer.put_line('loops.resize(%s);' % len(self.loops))
+        # for debugging only, generated code uses the slots directly
+        for name, slot in sorted(self.loops.iteritems()):
+            writer.put_line('loop_indexes[%s] = %s;' % (get_string(name),
+                                                        slot))
+
+    def write(self, writer):
+        functions = []
+        for index, event in enumerate(self.scene.events):
+            functions.append(self.write_event(index, event))
+
+        for name in self.selections:
+            writer.put_line('ObjectList %s;' % name)
+        writer.put_newline()
+        for function in functions:
+            writer.put_code(function)
+
+        for slot, events in enumerate(self.loop_events):
+            writer.put_func('void loop_%s' % slot)
+            for name in events:
+                writer.put_line('%s();' % name)
+            writer.end_brace()
+            writer.put_newline()
+
+        writer.put_func('void handle_events')
+        if self.triggered:
+            # triggers pushed by triggered events are handled in the same
+            # pass, ones pushed by polled events wait for the next tick
+            writer.put_line('for (size_t i = 0; i < triggers.size(); i++) {')
+            writer.indent()
+            writer.put_line('Trigger trigger = triggers[i];')
+            writer.put_line('switch (trigger.type) {')
+            writer.indent()
+            for trigger_type in TRIGGER_TYPES:
+                events = self.triggered.get(trigger_type, None)
+                if not events:
+                    continue
+                writer.put_line('case %s:' % self.get_trigger_name(
+                    trigger_type))
+                writer.indent()
+                for name, parameter, argument in events:
+                    if parameter is None:
+                        writer.put_line('%s(%s);' % (name, argument))
+                    else:
+                        writer.put_line('if (trigger.parameter == %s) '
+                            '%s(%s);' % (parameter, name, argument))
+                writer.put_line('break;')
+                writer.dedent()
+            writer.end_brace()
+            writer.end_brace()
+        writer.put_line('clear_triggers();')
+        for name in self.polled:
+            writer.put_line('%s();' % name)
+        writer.end_brace()
+
+    def get_trigger_name(self, trigger_type):
+        return 'TRIGGER_%s' % trigger_type.upper()
+
+    def write_event(self, index, event):
+        name = 'event_%s' % index
+        self.event_index = index
+        self.selected = {}
+        self.trigger = None
+        self.loop = None
+        writer = self.builder.create_writer()
+        object_trigger = self.get_object_trigger(event)
+        if object_trigger is None:
+            writer.put_func('void %s' % name)
+        else:
+            writer.put_func('void %s' % name, 'SceneObject * object')
+
+        # the body is written first, so only the instance lists it reads
+        # are looked up, once per type and event
+        self.used_instances = set()
+        body = self.builder.create_writer()
+        body.indentation = writer.indentation
+
+        if object_trigger is not None:
+            selection = self.select(object_trigger['object_type'])
+            body.put_line('%s.clear();' % selection)
+            body.put_line('%s.push_back(object);' % selection)
+
+        for condition in event.conditions:
+            self.write_condition(body, condition)
+
+        self.write_actions(body, event.actions)
+
+        for type_id in sorted(self.used_instances):
+            writer.put_line('ObjectList & instances_%s = get_instances(%s);'
+                % (type_id, type_id))
+        writer.put(body.get_data())
+        writer.end_brace()
+        writer.put_newline()
+
+        if self.loop is not None:
+            if self.trigger is not None:
+                raise ValueError('loop events cannot have a trigger')
+            self.loop_events[self.loop].append(name)
+        elif self.trigger is None:
+            self.polled.append(name)
+        else:
+            trigger_type, parameter = self.trigger
+            argument = ''
+            if object_trigger is not None:
+                argument = 'trigger.object'
+            self.triggered.setdefault(trigger_type, []).append(
+                (name, parameter, argument))
+        return writer
+
+    def get_object_key(self, data):
+        # type id, or 'gN' for groups
+        if 'group' in data:
+            return 'g%s' % self.builder.group_names[data['group']]
+        return data.get('object_type', None)
+
+    def get_list(self, type_id):
+        # None for groups that are not selected
+        if type_id in self.selected:
+            return self.selected[type_id]
+        if isinstance(type_id, basestring):
+            return None
+        return self.get_instances(type_id)
+
+    def get_instances(self, type_id):
+        # all instances of a type, declared at the top of the event
+        self.used_instances.add(type_id)
+        return 'instances_%s' % type_id
+
+    def start_instance_loop(self, writer, type_id, selected = True):
+        # selected = False walks all instances even if the type is selected
+        if selected:
+            source = self.get_list(type_id)
+        elif isinstance(type_id, basestring):
+            source = None
+        else:
+            source = self.get_instances(type_id)
+        if source is None:
+            writer.put_line('for (GroupIterator it(this, group%s); '
+                '!it.done(); it.next()) {' % type_id[1:])
+        else:
+            writer.put_line('for (ObjectList::const_iterator it = %s.begin(); '
+                'it != %s.end(); it++) {' % (source, source))
+        writer.indent()
+        writer.put_line('SceneObject * instance = *it;')
+
+    def select(self, type_id):
+        if type_id not in self.selected:
+            name = 'selection_%s_%s' % (self.event_index, type_id)
+            self.selections.append(name)
+            self.selected[type_id] = name
+        return self.selected[type_id]
+
+    def get_object_class(self, type_id):
+        return self.project.object_types[type_id].get_class_name()
+
+    def get_template(self, data, generic, attribute):
+        name = data['name']
+        type_id = data.get('object_type', None)
+        if name in generic:
+            return generic[name], False
+        if type_id is not None:
+            object_type = self.project.object_types[type_id]
+            templates = getattr(object_type, attribute)
+            if name in templates:
+                return templates[name], True
+        raise NotImplementedError('%s not supported' % name)
+
+    def format(self, template, data, parameters, instance, cast):
+        if cast:
+            instance = '((%s*)%s)' % (self.get_object_class(
+                data['object_type']), instance)
+        comparison = data.get('comparison', '==')
+        if comparison not in COMPARISONS:
+            raise ValueError('invalid comparison %r' % comparison)
+        return template.format(*parameters, instance = instance,
+                               comparison = comparison)
+
+    def get_parameters(self, data, current = None):
+        # current is the type whose instance is being looped over. other
+        # object types referenced in the parameters use their first instance,
+        # and have to be checked for being empty by the caller
+        self.references = set()
+        return [self.get_expression(value, current)
+                for value in data.get('parameters', [])]
+
+    def get_expression(self, value, current):
+        if isinstance(value, bool):
+            return to_c('%s', value)
+        elif isinstance(value, (int, long)):
+            return str(value)
+        elif isinstance(value, float):
+            return repr(value)
+        elif isinstance(value, basestring):
+            return get_string(value)
+        kind = value['type']
+        if kind in BINARY_OPERATORS:
+            return '(%s %s %s)' % (self.get_expression(value['left'], current),
+                kind, self.get_expression(value['right'], current))
+        elif kind == 'key':
+            return get_key(value['name'])
+        elif kind == 'loop_index':
+            return 'loops[%s].index' % self.get_loop(value)
+        parameters = [self.get_expression(item, current)
+                      for item in value.get('parameters', [])]
+        data = {'name' : kind, 'object_type' : value.get('object_type', None)}
+        type_id = data['object_type']
+        if type_id is None:
+            template, cast = self.get_template(data, EXPRESSIONS, None)
+            return self.format(template, data, parameters, None, False)
+        template, cast = self.get_template(data, OBJECT_EXPRESSIONS,
+                                           'expressions')
+        if type_id == current:
+            instance = 'instance'
+        else:
+            self.references.add(type_id)
+            instance = '%s[0]' % self.get_list(type_id)
+        return self.format(template, data, parameters, instance, cast)
+
+    def get_empty_check(self):
+        return ' || '.join(['%s.empty()' % self.get_list(type_id)
+                            for type_id in sorted(self.references)])
+
+    def write_condition(self, writer, condition):
+        name = condition['name']
+        if name in TRIGGER_CONDITIONS:
+            if self.trigger is not None:
+                raise ValueError('event has more than one trigger')
+            trigger_type, index = TRIGGER_CONDITIONS[name]
+            parameter = None
+            if index is not None:
+                parameter = self.get_parameters(condition)[index]
+            self.trigger = (trigger_type, parameter)
+            return
+        elif name in OBJECT_TRIGGER_CONDITIONS:
+            if self.trigger is not None:
+                raise ValueError('event has more than one trigger')
+            # the selection is set up in write_event()
+            self.trigger = (OBJECT_TRIGGER_CONDITIONS[name],
+                            condition['object_type'])
+            return
+        elif name == 'on_loop':
+            if self.loop is not None:
+                raise ValueError('event has more than one loop condition')
+            self.loop = self.get_loop(condition)
+            return
+
+        negated = condition.get('negated', False)
+        if name == 'always' and not negated:
+            return
+        type_id = self.get_object_key(condition)
+        if type_id is None:
+            template, cast = self.get_template(condition, CONDITIONS, None)
+            parameters = self.get_parameters(condition)
+            test = self.format(template, condition, parameters, None, False)
+            if not negated:
+                test = '!(%s)' % test
+            check = self.get_empty_check()
+            if check:
+                test = '%s || %s' % (check, test)
+            writer.put_line('if (%s) return;' % test)
+            return
+
+        template, cast = self.get_template(condition, OBJECT_CONDITIONS,
+                                           'conditions')
+        parameters = self.get_parameters(condition, type_id)
+        test = self.format(template, condition, parameters, 'instance', cast)
+        if negated:
+            test = '!(%s)' % test
+        check = self.get_empty_check()
+        if check:
+            writer.put_line('if (%s) return;' % check)
+        if type_id in self.selected:
+            selection = self.selected[type_id]
+            # filter the selection in place
+            writer.put_line('{')
+            writer.indent()
+            writer.put_line('size_t count = 0;')
+            writer.put_line('for (size_t i = 0; i < %s.size(); i++) {'
+                % selection)
+            writer.indent()
+            writer.put_line('SceneObject * instance = %s[i];' % selection)
+            writer.put_line('if (%s)' % test)
+            writer.put_line('    %s[count++] = instance;' % selection)
+            writer.end_brace()
+            writer.put_line('%s.resize(count);' % selection)
+            writer.end_brace()
+        else:
+            # first filter for this type copies matches into the scratch list
+            selection = self.select(type_id)
+            writer.put_line('%s.clear();' % selection)
+            self.start_instance_loop(writer, type_id, False)
+            writer.put_line('if (%s)' % test)
+            writer.put_line('    %s.push_back(instance);' % selection)
+            writer.end_brace()
+        writer.put_line('if (%s.empty()) return;' % selection)
+
+    def write_actions(self, writer, actions):
+        # consecutive actions on the same instances share one loop
+        group = []
+        for action in actions:
+            name = action['name']
+            if name in ('create_object', 'start_loop', 'stop_loop'):
+                self.write_action_loop(writer, group)
+                group = []
+                if name == 'create_object':
+                    self.write_create(writer, action)
+                elif name == 'start_loop':
+                    self.write_start_loop(writer, action)
+                else:
+                    writer.put_line('loops[%s].running = false;' %
+                        self.get_loop(action))
+                continue
+            type_id = self.get_object_key(action)
+            if type_id is None:
+                raise NotImplementedError('%s not supported' % name)
+            template, cast = self.get_template(action, OBJECT_ACTIONS,
+                                               'actions')
+            parameters = self.get_parameters(action, type_id)
+            code = self.format(template, action, parameters, 'instance', cast)
+            key = (type_id, self.get_list(type_id), self.get_empty_check())
+            if group and group[0][0] != key:
+                self.write_action_loop(writer, group)
+                group = []
+            group.append((key, code))
+        self.write_action_loop(writer, group)
+
+    def write_action_loop(self, writer, group):
+        if not group:
+            return
+        type_id, source, check = group[0][0]
+        if check:
+            writer.put_line('if (!(%s)) {' % check)
+            writer.indent()
+        self.start_instance_loop(writer, type_id)
+        for key, code in group:
+            writer.put_line('%s;' % code)
+        writer.end_brace()
+        if check:
+            writer.end_brace()
+
+    def write_create(self, writer, action):
+        # the created object becomes the selection of its type for the rest
+        # of the event
+        type_id = action['object_type']
+        parameters = self.get_parameters(action)
+        check = self.get_empty_check()
+        selection = self.select(type_id)
+        writer.put_line('%s.clear();' % selection)
+        if check:
+            writer.put_line('if (!(%s)) {' % check)
+        else:
+            writer.put_line('{')
+        writer.indent()
+        x, y = ['(int)%s' % item if not item.isdigit() else item
+                for item in parameters[:2]]
+        writer.put_line('SceneObject * created = new %s(%s, %s);' % (
+            self.builder.object_type_names[type_id], x, y))
+        if len(parameters) > 2:
+            # z defaults to 0 when only the layer is given
+            layer = parameters[2]
+            if len(parameters) > 3:
+                z = parameters[3]
+            else:
+                z = '0'
+            writer.put_line('add_object(created, %s, %s);' % (layer, z))
+        else:
+            writer.put_line('add_object(created);')
+        writer.put_line('%s.push_back(created);' % selection)
+        writer.end_brace()
+
+    def write_start_loop(self, writer, action):
+        slot = self.get_loop(action)
+        times = self.get_parameters(action)[1]
+        check = self.get_empty_check()
+        if check:
+            writer.put_line('if (!(%s)) {' % check)
+        else:
+            writer.put_line('{')
+        writer.indent()
+        writer.put_line('Loop & loop = loops[%s];' % slot)
+        writer.put_line('int times = %s;' % times)
+        writer.put_line('loop.running = true;')
+        writer.put_line('for (loop.index = 0; loop.running && '
+            'loop.index < times; loop.index++)')
+        writer.put_line('    loop_%s();' % slot)
+        writer.put_line('loop.running = false;')
+        writer.end_brace()
@@ -0,0 +1,237 @@
+# Copyright (c) Mathias Kaerlev
+# See LICENSE for details.
+
+# offline font baking: rasterizes the characters a project uses into an
+# atlas image and a binary metrics table read by runtime/bakedfont.h
+
+import struct
+from PySide.QtGui import QImage
+
+BAKE_MAGIC = 0x42464843 # 'CHFB'
+BAKE_VERSION = 2
+
+# see BakedFont in runtime/bakedfont.h
+PAGE_BITS = 8
+PAGE_SIZE = 1 << PAGE_BITS
+PAGE_MASK = PAGE_SIZE - 1
+UNICODE_LIMIT = 0x110000
+PAGE_COUNT = UNICODE_LIMIT >> PAGE_BITS
+NO_PAGE = 0xFFFFFFFF
+
+PADDING = 1
+MAX_ATLAS_SIZE = 4096
+
+# printable ASCII, see CodeData.font_ranges
+DEFAULT_RANGES = [(0x20, 0x7F)]
+
+def get_characters(text, ranges = None):
+    if ranges is None:
+        ranges = DEFAULT_RANGES
+    characters = set()
+    for value in text:
+        if isinstance(value, str):
+            value = value.decode('utf-8')
+        for c in value:
+            characters.add(ord(c))
+    for start, end in ranges:
+        characters.update(xrange(start, end))
+    characters.discard(ord('\n'))
+    return sorted(characters)
+
+def write_charmap(values):
+    pages = {}
+    blocks = []
+    for code, value in values:
+        if code >= UNICODE_LIMIT:
+            continue
+        page = code >> PAGE_BITS
+        if page not in pages:
+            pages[page] = len(blocks)
+            blocks.extend([0] * PAGE_SIZE)
+        blocks[pages[page] + (code & PAGE_MASK)] = value
+    words = [len(blocks)]
+    for page in xrange(PAGE_COUNT):
+        words.append(pages.get(page, NO_PAGE))
+    words.extend(blocks)
+    return struct.pack('<%sI' % len(words), *words)
+
+def next_power_of_two(value):
+    size = 1
+    while size < value:
+        size *= 2
+    return size
+
+def pack_glyphs(glyphs):
+    # simple shelf packer, tallest glyphs first
+    order = sorted(glyphs, key = lambda glyph: -glyph.height)
+    area = sum([(glyph.width + PADDING) * (glyph.height + PADDING)
+                for glyph in glyphs])
+    width = max(64, next_power_of_two(int(area ** 0.5)))
+    while width <= MAX_ATLAS_SIZE:
+        x = y = PADDING
+        shelf = 0
+        fits = True
+        for glyph in order:
+            if x + glyph.width + PADDING > width:
+                x = PADDING
+                y += shelf + PADDING
+                shelf = 0
+            if glyph.width + PADDING * 2 > width:
+                fits = False
+                break
+            glyph.x, glyph.y = x, y
+            x += glyph.width + PADDING
+            shelf = max(shelf, glyph.height)
+        height = next_power_of_two(y + shelf + PADDING)
+        if fits and height <= width:
+            return width, height
+        width *= 2
+    raise ValueError('font atlas exceeds %s pixels' % MAX_ATLAS_SIZE)
+
+class Font(object):
+    def __init__(self, filename, size):
+        self.filename = filename
+        self.size = size
+
+    def get_key(self):
+        return (self.filename, self.size)
+
+class BakedGlyph(object):
+    x = y = 0
+
+    def __init__(self, code, slot):
+        self.code = code
+        self.advance = slot.advance.x / 64.0
+        self.left = slot.bitmap_left
+        self.top = slot.bitmap_top
+        bitmap = slot.bitmap
+        self.width = bitmap.width
+        self.height = bitmap.rows
+        pitch = bitmap.pitch
+        data = bitmap.buffer
+        self.rows = [data[row * pitch:row * pitch + self.width]
+                     for row in xrange(self.height)]
+
+def make_atlas(glyphs, width, height):
+    # white ARGB32 pixels in memory order (B, G, R, A), only the alpha bytes
+    # are written per glyph row
+    pixels = bytearray('\xff\xff\xff\x00' * (width * height))
+    for glyph in glyphs:
+        for row, values in enumerate(glyph.rows):
+            start = ((glyph.y + row) * width + glyph.x) * 4 + 3
+            pixels[start:start + glyph.width * 4:4] = bytearray(values)
+    return QImage(str(pixels), width, height, QImage.Format_ARGB32).copy()
+
+def get_sfnt_table(data, tag):
+    offset = 0
+    if data[:4] == 'ttcf':
+        # first face of a collection, like freetype.Face(filename)
+        offset, = struct.unpack_from('>I', data, 12)
+    count, = struct.unpack_from('>H', data, offset + 4)
+    for index in xrange(count):
+        record = offset + 12 + index * 16
+        name, _, start, length = struct.unpack_from('>4sIII', data, record)
+        if name == tag:
+            return data[start:start + length]
+    return None
+
+def read_kerning(filename):
+    """
+    Returns {(left, right): value} in font units from the TrueType 'kern'
+    table, read the same way as FTFace::BuildKerningCache in
+    runtime/font.cpp.
+    """
+    pairs = {}
+    try:
+        table = get_sfnt_table(open(filename, 'rb').read(), 'kern')
+    except (IOError, struct.error):
+        return pairs
+    if table is None or len(table) < 4:
+        return pairs
+    version, count = struct.unpack_from('>HH', table, 0)
+    if version != 0:
+        # Apple's version 1 layout
+        return pairs
+    offset = 4
+    for _ in xrange(count):
+        if offset + 6 > len(table):
+            return {}
+        _, length, coverage = struct.unpack_from('>HHH', table, offset)
+        start = offset + 14
+        offset += length
+        horizontal = coverage & 0x01
+        minimum = coverage & 0x02
+        cross_stream = coverage & 0x04
+        overrides = coverage & 0x08
+        if not horizontal or minimum or cross_stream:
+            continue
+        if (coverage >> 8) != 0 or start > len(table):
+            # format 2 class tables etc.
+            return {}
+        pair_count, = struct.unpack_from('>H', table, start - 8)
+        # large tables overflow the 16-bit subtable length
+        offset = start + pair_count * 6
+        if offset > len(table):
+            return {}
+        for index in xrange(pair_count):
+            left, right, value = struct.unpack_from('>HHh', table,
+                                                    start + index * 6)
+            if not overrides:
+                value += pairs.get((left, right), 0)
+            pairs[(left, right)] = value
+    return pairs
+
+def bake_font(filename, size, characters):
+    """
+    Rasterizes `characters` from the font at `filename` and `size` and
+    returns (atlas QImage, metrics string).
+    """
+    import freetype
+    face = freetype.Face(filename)
+    face.set_char_size(size * 64)
+
+    glyphs = []
+    indices = {}
+    for code in characters:
+        index = face.get_char_index(code)
+        if index == 0 and code != 0:
+            continue
+        face.load_glyph(index, freetype.FT_LOAD_RENDER |
+                               freetype.FT_LOAD_NO_HINTING)
+        glyphs.append(BakedGlyph(code, face.glyph))
+        indices[code] = index
+
+    width, height = pack_glyphs(glyphs)
+    atlas = make_atlas(glyphs, width, height)
+
+    kerning = []
+    positions = {}
+    for glyph_index, glyph in enumerate(glyphs):
+        positions.setdefault(indices[glyph.code], []).append(glyph_index)
+    scale = size / float(face.units_per_EM)
+    for (left, right), value in read_kerning(filename).iteritems():
+        if value == 0 or left not in positions or right not in positions:
+            continue
+        for left_index in positions[left]:
+            for right_index in positions[right]:
+                kerning.append((left_index, right_index, value * scale))
+
+    metrics = face.size
+    data = [struct.pack('<II', BAKE_MAGIC, BAKE_VERSION),
+            struct.pack('<ffff', size, metrics.ascender / 64.0,
+                        metrics.descender / 64.0, metrics.height / 64.0),
+            struct.pack('<III', width, height, len(glyphs))]
+    for glyph in glyphs:
+        data.append(struct.pack('<I9f', glyph.code, glyph.advance,
+            glyph.left, glyph.top, glyph.width, glyph.height,
+            glyph.x / float(width), glyph.y / float(height),
+            (glyph.x + glyph.width) / float(width),
+            (glyph.y + glyph.height) / float(height)))
+    # sorted by (left, right) for binary search at runtime
+    kerning.sort()
+    data.append(struct.pack('<I', len(kerning)))
+    for left, right, value in kerning:
+        data.append(struct.pack('<IIf', left, right, value))
+    data.append(write_charmap([(glyph.code, index + 1)
+                               for index, glyph in enumerate(glyphs)]))
+    return atlas, ''.join(data)
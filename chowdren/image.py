@@ -2,22 +2,86 @@
 # See LICENSE for details.
 
 import os
-from PySide.QtGui import QPixmap
+import sys
+import hashlib
+from PySide.QtGui import QPixmap, QImage
+
+# offset of the alpha byte in an ARGB32 pixel, which is stored as a native
+# 32-bit integer
+if sys.byteorder == 'little':
+    ALPHA_OFFSET = 3
+else:
+    ALPHA_OFFSET = 0
+
+# bumped when get_hash changes, so hashes stored in projects are dropped
+HASH_VERSION = 2
 
 class Image(object):
     id = None
     hotspot_x = hotspot_y = 0.0
+    image_hash = None
+    loaded_pixmap = None
 
     def __init__(self, filename, hotspot_x = 0, hotspot_y = 0):
-        self.pixmap = QPixmap(filename)
+        self.filename = filename
         self.hotspot_x, self.hotspot_y = hotspot_x, hotspot_y
 
+    @property
+    def pixmap(self):
+        # read the first time the image is drawn, measured or exported
+        if self.loaded_pixmap is None:
+            self.loaded_pixmap = QPixmap(self.filename)
+        return self.loaded_pixmap
+
     def draw(self, painter, x = 0.0, y = 0.0):
         painter.drawPixmap(x - self.hotspot_x, y - self.hotspot_y, self.pixmap)
 
     def save(self, filename):
+        if self.loaded_pixmap is None and filename == self.filename:
+            # never loaded, so the file is unchanged
+            return
         self.pixmap.save(filename)
 
+    def get_hash(self):
+        # of the pixels only, the hotspot is written to images.h. cached
+        # until ProjectManager.save_image rehashes a loaded image
+        if self.image_hash is None:
+            image = self.pixmap.toImage().convertToFormat(
+                QImage.Format_ARGB32)
+            width, height = image.width(), image.height()
+            stride = image.bytesPerLine()
+            # the raw ARGB32 pixels, alpha included
+            md5 = hashlib.md5('%s %s %s\n' % (width, height, stride))
+            md5.update(str(image.constBits())[:stride * height])
+            self.image_hash = md5.hexdigest()
+        return self.image_hash
+
+    def get_trim_box(self):
+        # (x, y, width, height) of the part that is not fully transparent,
+        # followed by the full width and height
+        image = self.pixmap.toImage().convertToFormat(QImage.Format_ARGB32)
+        width, height = image.width(), image.height()
+        bits = str(image.constBits())
+        stride = image.bytesPerLine()
+        rows = []
+        for y in xrange(height):
+            start = y * stride + ALPHA_OFFSET
+            rows.append(bits[start:start + width * 4:4])
+        opaque = [y for y, row in enumerate(rows) if row.strip('\x00')]
+        if not opaque:
+            # nothing to draw, but the texture still needs a pixel
+            return (0, 0, 1, 1, width, height)
+        top = opaque[0]
+        bottom = opaque[-1] + 1
+        rows = rows[top:bottom]
+        left = min([len(row) - len(row.lstrip('\x00')) for row in rows])
+        right = max([len(row.rstrip('\x00')) for row in rows])
+        return (left, top, right - left, bottom - top, width, height)
+
+    def save_trimmed(self, filename, box):
+        x, y, width, height = box[:4]
+        self.pixmap.copy(x, y, width, height).save(filename)
+
     def get_bounding_box(self):
         img = self.pixmap
         return (-self.hotspot_x, -self.hotspot_y, img.width(), img.height())
@@ -28,7 +28,24 @@ def get_objects():
 
     return state.objects
 
+# movement kinds, see runtime/movement.h
+MOVEMENT_TYPES = ('ball', 'eight_directions', 'path')
+
 class ObjectBase(object):
+    # None or a dict with 'type' (one of MOVEMENT_TYPES) and 'speed' in
+    # pixels per second. ball movements also use 'angle' and 'bounce', path
+    # movements 'nodes' (list of (x, y) relative to the start) and 'loop'.
+    movement = None
+
+    # C++ templates for events, see chowdren/events.py. {instance} is a
+    # pointer to the runtime class
+    conditions = {}
+    actions = {}
+    expressions = {}
+
+    # files from runtime/ the object type needs compiled in, e.g. font.cpp
+    runtime_sources = []
+
     def __init__(self, project, data = None):
         self.project = project
         self.get_image = project.get_image
@@ -55,6 +72,7 @@ class ObjectBase(object):
         object_type = ObjectType()
         object_type.name = self.get_class_name()
         object_type.type_id = self.id
+        object_type.movement = self.movement
         object_type.data = {}
         self.write(object_type.data)
         return object_type
@@ -64,6 +82,19 @@ class ObjectBase(object):
     def get_parameters(self):
         return []
 
+    def write_tables(self, writer, builder):
+        # constant data shared by all instances, written before the class
+        pass
+
+    def get_fonts(self):
+        # list of (Font, text) pairs to bake at build time
+        return []
+
+    def get_runtime_files(self):
+        # list of (source, destination) files the runtime loads, with
+        # destination relative to the output directory
+        return []
+
     @classmethod
     def get_runtime(cls):
         name = cls.__module__
@@ -3,12 +3,22 @@
 
 import os
 
-from chowdren.image import Image
+from chowdren.image import Image, HASH_VERSION
 from chowdren.common import IDPool
 from chowdren.object import get_objects
-from chowdren.data import CodeData
+from chowdren.data import CodeData, get_backup_file
+
+PROJECT_FILENAME = 'project.chp'
+# repr() of the project data, written by older versions
+LEGACY_FILENAME = 'application.py'
 
 class ProjectManager(object):
+    """
+    Object types, images and scene contents are only materialized when they
+    are used. self.data.object_types and the image files act as the index,
+    so ids are never handed out twice for things that are not loaded yet.
+    """
+
     base_dir = None
     def __init__(self, directory = None):
         self.base_dir = directory
@@ -16,21 +26,52 @@ class ProjectManager(object):
         self.object_type_ids = IDPool()
         self.images = {}
         self.image_ids = IDPool()
+        # pixel hash -> image id, so identical images share one file
+        self.image_refs = {}
         if directory is None:
             self.data = CodeData()
+            self.data.image_hash_version = HASH_VERSION
             return
-        with open(self.get_application_file(), 'rb') as fp:
-            self.data = CodeData.load(fp)
+        filename = self.get_application_file()
+        if not os.path.isfile(filename):
+            backup = get_backup_file(filename)
+            if os.path.isfile(backup):
+                # interrupted while saving
+                filename = backup
+            else:
+                filename = os.path.join(self.base_dir, LEGACY_FILENAME)
+        self.data = CodeData.load_file(filename)
+        for type_id in self.data.object_types:
+            self.object_type_ids.pop(type_id)
+        for name in os.listdir(self.base_dir):
+            ref, ext = os.path.splitext(name)
+            if ext == '.png' and ref.isdigit():
+                self.image_ids.pop(int(ref))
+        if self.data.image_hash_version != HASH_VERSION:
+            # made by an older get_hash, rehashed as images are saved
+            self.data.image_hashes = {}
+            self.data.image_hash_version = HASH_VERSION
+        image_hashes = self.data.image_hashes
+        for ref, image_hash in image_hashes.items():
+            if not self.image_ids.is_taken(ref):
+                # the file is gone
+                del image_hashes[ref]
+                continue
+            self.image_refs.setdefault(image_hash, ref)
 
     def get_application_file(self):
-        return os.path.join(self.base_dir, 'application.py')
+        return os.path.join(self.base_dir, PROJECT_FILENAME)
+
+    def get_session_file(self):
+        # input recorded with the runtime's -record option, used for the
+        # training run of profile-guided builds
+        return os.path.join(self.base_dir, 'session.rec')
 
     def save(self):
-        self.data.object_types = {}
+        # types that were never loaded keep their stored data
         for k, v in self.object_types.iteritems():
             self.data.object_types[k] = v.get_data()
-        with open(self.get_application_file(), 'wb') as fp:
-            self.data.save(fp)
+        self.data.save_file(self.get_application_file())
 
     def set_directory(self, directory):
         self.base_dir = directory
@@ -44,18 +85,59 @@ class ProjectManager(object):
         image = Image(self.get_image_file(ref))
         self.image_ids.pop(ref)
         image.id = ref
+        # known from when it was saved, so the builder does not have to load
+        # the pixmap to hash it
+        image.image_hash = self.data.image_hashes.get(ref, None)
         self.images[ref] = image
         return image
 
     def save_image(self, image):
         if image.id is None:
+            image_hash = image.get_hash()
+            ref = self.image_refs.get(image_hash, None)
+            if ref is not None:
+                # identical to an image that is already saved
+                image.id = ref
+                return ref
             image.id = self.image_ids.pop()
             self.images[image.id] = image
+            self.image_refs[image_hash] = image.id
+            self.data.image_hashes[image.id] = image_hash
+        elif image.loaded_pixmap is not None:
+            # the pixmap may have been edited since it was hashed
+            old_hash = self.data.image_hashes.get(image.id, None)
+            if self.image_refs.get(old_hash, None) == image.id:
+                del self.image_refs[old_hash]
+            image.image_hash = None
+            image_hash = image.get_hash()
+            self.image_refs.setdefault(image_hash, image.id)
+            self.data.image_hashes[image.id] = image_hash
         image.save(self.get_image_file(image.id))
         return image.id
 
+    # scene management
+
+    def open_scene(self, index):
+        # for the editor, the scene stays loaded from now on
+        scene = self.data.scenes[index]
+        scene.load()
+        return scene
+
+    def read_scene(self, index):
+        # for one pass over every scene, like the builder does: scenes that
+        # are not loaded are parsed into a copy that is not kept
+        scene = self.data.scenes[index]
+        if scene.is_loaded():
+            return scene
+        return scene.copy()
+
     # object type management
 
+    def load_object_types(self):
+        for type_id in self.data.object_types:
+            self.get_object_type(type_id)
+        return self.object_types
+
     def create_object_type(self, klass):
         object_type = klass(self)
         object_type.id = self.object_type_ids.pop()
@@ -68,6 +150,7 @@ class ProjectManager(object):
         type_data = self.data.object_types[ref]
         object_type = get_objects()[type_data.name](self, type_data.data)
         object_type.id = type_data.type_id
+        object_type.movement = type_data.movement
         self.object_type_ids.pop(object_type.id)
         self.object_types[ref] = object_type
         return object_type
\ No newline at end of file
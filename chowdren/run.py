@@ -12,6 +12,7 @@ global_application.setStyle("cleanlooks")
 from PySide.QtCore import Qt
 from OpenGL import GL
 from chowdren.build import build
+from chowdren.driver import record_session
 from chowdren.project import ProjectManager
 from chowdren.object import get_objects
 from chowdren.image import Image
@@ -277,7 +278,7 @@ class EventEditor(QtGui.QWidget):
         self.add_layout(layout, index)
 
 class MainWindow(QtGui.QMainWindow):
-    build_timer = build_generator = None
+    build_timer = build_driver = None
     def __init__(self, app):
         super(MainWindow, self).__init__()
 
@@ -292,10 +293,14 @@ class MainWindow(QtGui.QMainWindow):
         self.workspace = self.create_dock(Workspace, 'Workspace', 
             Qt.LeftDockWidgetArea)
 
+        self.build_log = self.create_dock(QtGui.QPlainTextEdit, 'Build',
+            Qt.BottomDockWidgetArea)
+        self.build_log.setReadOnly(True)
+
         for scene in self.data.scenes:
             self.workspace.add_scene(scene)
 
-        scene_data = self.data.scenes[0]
+        scene_data = self.project.open_scene(0)
         self.graphics_scene = Scene(self, scene_data)
         self.scenes = [self.graphics_scene]
         self.graphics_view = QtGui.QGraphicsView(self.graphics_scene)
@@ -340,6 +345,16 @@ class MainWindow(QtGui.QMainWindow):
             shortcut = QtGui.QKeySequence('Ctrl+B'), 
             triggered = self.build_selected)
         self.file.addAction(self.build_action)
+        self.debug_build_action = QtGui.QAction('Build &Debug', self,
+            shortcut = QtGui.QKeySequence('Ctrl+Shift+B'), 
+            triggered = self.debug_build_selected)
+        self.file.addAction(self.debug_build_action)
+        self.record_action = QtGui.QAction('&Record Session', self,
+            triggered = self.record_selected)
+        self.file.addAction(self.record_action)
+        self.optimized_build_action = QtGui.QAction('Build &Optimized', self,
+            triggered = self.optimized_build_selected)
+        self.file.addAction(self.optimized_build_action)
 
         self.addToolBar('Main')
 
@@ -399,22 +414,71 @@ class MainWindow(QtGui.QMainWindow):
         # if we are entering a longer, blocking call
         self.app.processEvents()
 
+    def get_build_directory(self):
+        return os.path.join(os.getcwd(), 'out')
+
     def build_selected(self):
+        self.start_build(('Release',))
+
+    def debug_build_selected(self):
+        self.start_build(('Debug',))
+
+    def optimized_build_selected(self):
+        # profile-guided, trained with the recorded session
+        self.save()
+        if self.project.base_dir is None:
+            return
+        session = self.project.get_session_file()
+        if not os.path.isfile(session):
+            self.set_status('Record a session first.')
+            return
+        self.start_build((), session)
+
+    def record_selected(self):
+        self.save()
+        if self.project.base_dir is None:
+            return
+        process = record_session(self.get_build_directory(),
+            self.project.get_session_file())
+        if process is None:
+            self.set_status('Build the project first.')
+            return
+        self.set_status('Recording session...')
+
+    def start_build(self, configurations, session = None):
+        if self.build_driver is not None:
+            return
         self.save()
         self.set_status('Building...')
-        self.build_generator = build(self.project, os.path.join(os.getcwd(), 
-            'out'))
+        self.build_log.clear()
+        try:
+            self.build_driver = build(self.project, self.get_build_directory(),
+                configurations, session = session)
+        except ValueError, e:
+            # invalid project data, like a Text object without a font
+            self.build_log.appendPlainText(str(e))
+            self.set_status('Build failed.')
+            return
         self.build_timer = QtCore.QTimer(self)
         self.build_timer.timeout.connect(self.update_build)
-        self.build_timer.start(0.1)
+        self.build_timer.start(100)
 
     def update_build(self):
-        try:
-            self.build_generator.next()
-        except StopIteration:
-            self.build_timer.stop()
-            self.build_timer = self.build_generator = None
+        driver = self.build_driver
+        # check before draining, so no output is lost if a job finishes
+        # in between
+        done = driver.is_done()
+        for line in driver.get_output():
+            self.build_log.appendPlainText(line)
+        if not done:
+            return
+        self.build_timer.stop()
+        self.build_timer = self.build_driver = None
+        if driver.get_successful():
             self.set_status('Build finished.')
+            driver.run()
+        else:
+            self.set_status('Build failed.')
 
     def create_dock(self, widget_class, name, area):
         dock = QtGui.QDockWidget(name, self)
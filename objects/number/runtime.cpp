@@ -1,73 +1,172 @@
 // Copyright (c) Mathias Kaerlev
 // See LICENSE for details.
 
+// image indices used by Number, matching the image order from the builder
+#define NUMBER_MINUS 10
+#define NUMBER_PLUS 11
+#define NUMBER_POINT 12
+#define NUMBER_EXPONENT 13
+
+// enough for "-1.23457e+308"
+#define NUMBER_MAX_CHARS 16
+
+// Writes value to out as image indices with the same output as
+// std::ostream << double (%g with 6 significant digits). Does not
+// allocate and does not depend on the locale. Returns the count written.
+inline int format_number(double value, unsigned char * out)
+{
+    int count = 0;
+    if (value != value || value - value != 0.0) // NaN or infinity
+        return 0;
+    if (value < 0.0) {
+        out[count++] = NUMBER_MINUS;
+        value = -value;
+    }
+
+    unsigned char tmp[10];
+    int n;
+
+    // integers below a million print as-is
+    if (value < 1000000.0 && value == floor(value)) {
+        unsigned int integer = (unsigned int)value;
+        n = 0;
+        do {
+            tmp[n++] = (unsigned char)(integer % 10);
+            integer /= 10;
+        } while (integer != 0);
+        while (n > 0)
+            out[count++] = tmp[--n];
+        return count;
+    }
+
+    // 6 significant digits as an integer mantissa
+    int exponent = (int)floor(log10(value));
+    int scale = 5 - exponent;
+    // extended precision keeps ties like 4079.435 rounding as printf does
+    long double scaled = value;
+    if (scale > 300) {
+        scaled *= 1e20L;
+        scale -= 20;
+    }
+    if (scale >= 0)
+        scaled *= pow(10.0L, scale);
+    else
+        scaled /= pow(10.0L, -scale);
+    if (scaled < 99999.5) {
+        // log10 rounded the wrong way
+        scaled *= 10.0;
+        exponent--;
+    }
+    // round half to even like printf
+    long double whole = floor(scaled);
+    unsigned int mantissa = (unsigned int)whole;
+    long double fraction = scaled - whole;
+    if (fraction > 0.5 || (fraction == 0.5 && (mantissa & 1)))
+        mantissa++;
+    if (mantissa >= 1000000) {
+        mantissa /= 10;
+        exponent++;
+    }
+
+    unsigned char digits[6];
+    for (n = 5; n >= 0; n--) {
+        digits[n] = (unsigned char)(mantissa % 10);
+        mantissa /= 10;
+    }
+    int significant = 6;
+    while (significant > 1 && digits[significant - 1] == 0)
+        significant--;
+
+    if (exponent < -4 || exponent >= 6) {
+        out[count++] = digits[0];
+        if (significant > 1) {
+            out[count++] = NUMBER_POINT;
+            for (n = 1; n < significant; n++)
+                out[count++] = digits[n];
+        }
+        out[count++] = NUMBER_EXPONENT;
+        if (exponent < 0) {
+            out[count++] = NUMBER_MINUS;
+            exponent = -exponent;
+        } else
+            out[count++] = NUMBER_PLUS;
+        n = 0;
+        do {
+            tmp[n++] = (unsigned char)(exponent % 10);
+            exponent /= 10;
+        } while (exponent != 0 || n < 2);
+        while (n > 0)
+            out[count++] = tmp[--n];
+        return count;
+    }
+
+    if (exponent < 0) {
+        out[count++] = 0;
+        out[count++] = NUMBER_POINT;
+        for (n = exponent + 1; n < 0; n++)
+            out[count++] = 0;
+        for (n = 0; n < significant; n++)
+            out[count++] = digits[n];
+        return count;
+    }
+
+    for (n = 0; n <= exponent; n++)
+        out[count++] = digits[n];
+    if (significant > exponent + 1) {
+        out[count++] = NUMBER_POINT;
+        for (; n < significant; n++)
+            out[count++] = digits[n];
+    }
+    return count;
+}
+
 class Number : public SceneObject
 {
 public:
     Image * images[14];
     double value;
     double minimum, maximum;
-    std::string cached_string;
+    unsigned char chars[NUMBER_MAX_CHARS];
+    int char_count;
+    bool chars_dirty;
 
     Number(int init, int min, int max, std::string name, 
            int x, int y, int type_id) 
-    : SceneObject(name, x, y, type_id), minimum(min), maximum(max)
+    : SceneObject(name, x, y, type_id), value(0.0), minimum(min),
+      maximum(max), char_count(0), chars_dirty(true)
     {
         set(init);
     }
 
-    Image * get_image(char c)
-    {
-        switch (c) {
-            case '0':
-            case '1':
-            case '2':
-            case '3':
-            case '4':
-            case '5':
-            case '6':
-            case '7':
-            case '8':
-            case '9':
-                return images[c - '0'];
-            case '-':
-                return images[10];
-            case '+':
-                return images[11];
-            case '.':
-                return images[12];
-            case 'e':
-                return images[13];
-            default:
-                return NULL;
-        }
-    }
-
     void add(double value) {
         set(this->value + value);
     }
 
     void set(double value) {
         value = std::max<double>(std::min<double>(value, maximum), minimum);
+        if (value == this->value)
+            return;
         this->value = value;
-
-        std::ostringstream str;
-        str << value;
-        cached_string = str.str();
+        chars_dirty = true;
+        changed(TRIGGER_VALUE_CHANGED);
     }
 
     void draw()
     {
+        if (chars_dirty) {
+            char_count = format_number(value, chars);
+            chars_dirty = false;
+        }
         glColor4f(1.0, 1.0, 1.0, 1.0);
         double current_x = x;
-        for (std::string::const_reverse_iterator it = cached_string.rbegin(); 
-             it < cached_string.rend(); it++) {
-            Image * image = get_image(it[0]);
+        for (int i = char_count - 1; i >= 0; i--) {
+            Image * image = images[chars[i]];
             if (image == NULL)
                 continue;
+            image->load();
             image->draw(current_x + image->hotspot_x - image->width, 
                         y + image->hotspot_y - image->height);
             current_x -= image->width;
         }
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,72 @@
+# Copyright (c) Mathias Kaerlev
+# See LICENSE for details.
+
+from chowdren.object import ObjectBase
+from chowdren.image import default_image
+
+class Particles(ObjectBase):
+    conditions = {
+        'compare_particle_count' : '{instance}->pool.count {comparison} {0}'
+    }
+
+    actions = {
+        'start_emitting' : '{instance}->emitting = true',
+        'stop_emitting' : '{instance}->emitting = false',
+        'emit' : '{instance}->emit({0})',
+        'set_rate' : '{instance}->rate = {0}'
+    }
+
+    def initialize(self):
+        self.image = default_image
+        self.capacity = 1000
+        self.rate = 100.0
+        self.life = 1.0
+        self.speed_min = 50.0
+        self.speed_max = 100.0
+        self.angle = 90.0
+        self.spread = 45.0
+        self.gravity = 0.0
+
+    def read(self, data):
+        self.image = self.get_image(data['image'])
+        self.capacity = data['capacity']
+        self.rate = data['rate']
+        self.life = data['life']
+        self.speed_min = data['speed_min']
+        self.speed_max = data['speed_max']
+        self.angle = data['angle']
+        self.spread = data['spread']
+        self.gravity = data['gravity']
+
+    def write(self, data):
+        data['image'] = self.save_image(self.image)
+        data['capacity'] = self.capacity
+        data['rate'] = self.rate
+        data['life'] = self.life
+        data['speed_min'] = self.speed_min
+        data['speed_max'] = self.speed_max
+        data['angle'] = self.angle
+        data['spread'] = self.spread
+        data['gravity'] = self.gravity
+
+    def get_bounding_box(self):
+        return self.image.get_bounding_box()
+
+    def draw(self, painter):
+        self.image.draw(painter)
+
+    # for runtime
+
+    def get_parameters(self):
+        return [self.image, self.capacity, self.rate, self.life,
+                self.speed_min, self.speed_max, self.angle, self.spread,
+                self.gravity]
+
+    def write_init(self, writer):
+        pass
+
+    def get_init_list(self):
+        return []
+
+def get_object():
+    return Particles
@@ -0,0 +1,204 @@
+// Copyright (c) Mathias Kaerlev
+// See LICENSE for details.
+
+#include "common.h"
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+// Particles live in a fixed-capacity structure-of-arrays pool owned by the
+// emitter. Integration runs over the packed arrays (4 at a time with SSE),
+// dead particles are recycled by moving the last live one into their slot,
+// and the whole pool is drawn with a single vertex array call.
+
+class ParticlePool
+{
+public:
+    int capacity, count;
+    float * x;
+    float * y;
+    float * vx;
+    float * vy;
+    float * life;
+
+    ParticlePool(int capacity)
+    : capacity(capacity), count(0)
+    {
+        // one block, each array 16-byte aligned and padded to a multiple
+        // of 4 so the SIMD loop never needs a scalar head
+        int stride = (capacity + 3) & ~3;
+        storage.resize(stride * 5 + 4);
+        float * base = &storage[0];
+        while (((size_t)base & 15) != 0)
+            base++;
+        x = base;
+        y = x + stride;
+        vx = y + stride;
+        vy = vx + stride;
+        life = vy + stride;
+    }
+
+    bool full()
+    {
+        return count >= capacity;
+    }
+
+    void add(float px, float py, float pvx, float pvy, float plife)
+    {
+        if (count >= capacity)
+            return;
+        x[count] = px;
+        y[count] = py;
+        vx[count] = pvx;
+        vy[count] = pvy;
+        life[count] = plife;
+        count++;
+    }
+
+    void integrate(float dt, float gravity)
+    {
+        int i = 0;
+#ifdef __SSE__
+        __m128 dt4 = _mm_set1_ps(dt);
+        __m128 gravity4 = _mm_set1_ps(gravity * dt);
+        for (; i < count; i += 4) {
+            __m128 pvy = _mm_add_ps(_mm_load_ps(vy + i), gravity4);
+            _mm_store_ps(vy + i, pvy);
+            _mm_store_ps(x + i, _mm_add_ps(_mm_load_ps(x + i),
+                _mm_mul_ps(_mm_load_ps(vx + i), dt4)));
+            _mm_store_ps(y + i, _mm_add_ps(_mm_load_ps(y + i),
+                _mm_mul_ps(pvy, dt4)));
+            _mm_store_ps(life + i, _mm_sub_ps(_mm_load_ps(life + i), dt4));
+        }
+#else
+        float gravity_step = gravity * dt;
+        for (; i < count; i++) {
+            vy[i] += gravity_step;
+            x[i] += vx[i] * dt;
+            y[i] += vy[i] * dt;
+            life[i] -= dt;
+        }
+#endif
+    }
+
+    void recycle()
+    {
+        int i = 0;
+        while (i < count) {
+            if (life[i] > 0.0f) {
+                i++;
+                continue;
+            }
+            count--;
+            x[i] = x[count];
+            y[i] = y[count];
+            vx[i] = vx[count];
+            vy[i] = vy[count];
+            life[i] = life[count];
+        }
+    }
+
+private:
+    std::vector<float> storage;
+};
+
+class Particles : public SceneObject
+{
+public:
+    Image * image;
+    ParticlePool pool;
+    float rate; // particles per second
+    float life_time; // seconds
+    float speed_min, speed_max; // pixels per second
+    float angle, spread; // degrees
+    float gravity; // pixels per second squared
+    float emit_time;
+    bool emitting;
+    std::vector<float> vertices;
+    std::vector<float> tex_coords;
+
+    Particles(Image * image, int capacity, float rate, float life_time,
+              float speed_min, float speed_max, float angle, float spread,
+              float gravity, std::string name, int x, int y, int type_id)
+    : SceneObject(name, x, y, type_id), image(image), pool(capacity),
+      rate(rate), life_time(life_time), speed_min(speed_min),
+      speed_max(speed_max), angle(angle), spread(spread), gravity(gravity),
+      emit_time(0.0f), emitting(true)
+    {
+        vertices.resize(capacity * 8);
+        tex_coords.resize(capacity * 8);
+        static const float quad[8] = {0.0f, 0.0f, 1.0f, 0.0f,
+                                      1.0f, 1.0f, 0.0f, 1.0f};
+        for (int i = 0; i < capacity; i++)
+            std::copy(quad, quad + 8, &tex_coords[i * 8]);
+    }
+
+    static inline float random_float(float a, float b)
+    {
+        return a + (b - a) * (rand() / (float)RAND_MAX);
+    }
+
+    void emit(int count)
+    {
+        float px = (float)x;
+        float py = (float)y;
+        for (int i = 0; i < count && !pool.full(); i++) {
+            float direction = angle + random_float(-spread, spread) * 0.5f;
+            float speed = random_float(speed_min, speed_max);
+            float sin_value, cos_value;
+            get_sin_cos(direction, sin_value, cos_value);
+            pool.add(px, py, cos_value * speed, -sin_value * speed,
+                     life_time);
+        }
+    }
+
+    void update(float dt)
+    {
+        pool.integrate(dt, gravity);
+        pool.recycle();
+        if (!emitting || rate <= 0.0f)
+            return;
+        emit_time += dt * rate;
+        int count = (int)emit_time;
+        emit_time -= count;
+        emit(count);
+    }
+
+    void draw()
+    {
+        int count = pool.count;
+        if (count == 0)
+            return;
+        image->load();
+        float x1 = (float)(image->trim_x - image->hotspot_x);
+        float y1 = (float)(image->trim_y - image->hotspot_y);
+        float x2 = x1 + image->trim_width;
+        float y2 = y1 + image->trim_height;
+        float * out = &vertices[0];
+        for (int i = 0; i < count; i++, out += 8) {
+            float px = pool.x[i];
+            float py = pool.y[i];
+            out[0] = px + x1;
+            out[1] = py + y1;
+            out[2] = px + x2;
+            out[3] = py + y1;
+            out[4] = px + x2;
+            out[5] = py + y2;
+            out[6] = px + x1;
+            out[7] = py + y2;
+        }
+
+        glColor4f(1.0, 1.0, 1.0, 1.0);
+        glEnable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, image->tex);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glVertexPointer(2, GL_FLOAT, 0, &vertices[0]);
+        glTexCoordPointer(2, GL_FLOAT, 0, &tex_coords[0]);
+        glDrawArrays(GL_QUADS, 0, count * 4);
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glDisable(GL_TEXTURE_2D);
+    }
+};
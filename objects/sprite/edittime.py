@@ -5,26 +5,145 @@ from chowdren.object import ObjectBase
 from chowdren.image import default_image
 from PySide.QtGui import QColor
 
+# see DIRECTION_COUNT in runtime.cpp
+DIRECTION_COUNT = 32
+
+class Direction(object):
+    def __init__(self, frames, min_speed = 0, max_speed = 100, repeat = True,
+                 back_to = 0):
+        self.frames = frames
+        self.min_speed = min_speed
+        self.max_speed = max_speed
+        self.repeat = repeat
+        self.back_to = back_to
+
+def get_closest_direction(directions, index):
+    # directions missing from an animation use the closest defined one,
+    # resolved here so the runtime never has to search
+    best = None
+    for other in directions:
+        distance = abs(other - index)
+        distance = min(distance, DIRECTION_COUNT - distance)
+        if best is None or distance < best[0]:
+            best = (distance, other)
+    return best[1]
+
 class Sprite(ObjectBase):
+    conditions = {
+        'compare_animation' : '{instance}->animation {comparison} {0}',
+        'compare_direction' : '{instance}->direction {comparison} {0}'
+    }
+
+    actions = {
+        'set_animation' : '{instance}->set_animation({0})',
+        'set_direction' : '{instance}->set_direction({0})',
+        'set_frame' : '{instance}->set_frame({0})',
+        'restart_animation' : '{instance}->restart_animation()',
+        'set_angle' : '{instance}->set_angle({0})',
+        'set_scale' : '{instance}->set_scale({0})',
+        'set_flip' : '{instance}->set_flip({0}, {1})'
+    }
+
+    expressions = {
+        'animation' : '{instance}->animation',
+        'direction' : '{instance}->direction',
+        'angle' : '{instance}->angle'
+    }
+
     def initialize(self):
-        self.image = default_image
+        # animation index -> direction index -> Direction
+        self.animations = {0: {0: Direction([default_image])}}
 
     def read(self, data):
-        self.image = self.get_image(data['image'])
+        self.animations = {}
+        if 'image' in data:
+            # single image sprites from older projects
+            image = self.get_image(data['image'])
+            self.animations[0] = {0: Direction([image])}
+            return
+        for animation in data['animations']:
+            directions = self.animations[animation['index']] = {}
+            for item in animation['directions']:
+                frames = [self.get_image(ref) for ref in item['frames']]
+                directions[item['index']] = Direction(frames,
+                    item['min_speed'], item['max_speed'], item['repeat'],
+                    item['back_to'])
 
     def write(self, data):
-        data['image'] = self.save_image(self.image)
+        data['animations'] = animations = []
+        for animation_index, directions in sorted(
+                self.animations.iteritems()):
+            items = []
+            for direction_index, direction in sorted(directions.iteritems()):
+                items.append({'index' : direction_index,
+                    'frames' : [self.save_image(image)
+                                for image in direction.frames],
+                    'min_speed' : direction.min_speed,
+                    'max_speed' : direction.max_speed,
+                    'repeat' : direction.repeat,
+                    'back_to' : direction.back_to})
+            animations.append({'index' : animation_index,
+                               'directions' : items})
+
+    def get_default_image(self):
+        animation = self.animations[min(self.animations)]
+        return animation[min(animation)].frames[0]
 
     def get_bounding_box(self):
-        return self.image.get_bounding_box()
+        return self.get_default_image().get_bounding_box()
 
     def draw(self, painter):
-        self.image.draw(painter)
+        self.get_default_image().draw(painter)
 
     # for runtime
 
+    def get_table_name(self):
+        return 'sprite%s' % self.id
+
+    def write_tables(self, writer, builder):
+        # animation data is shared by every instance of the type, so it is
+        # written once as constant tables
+        name = self.get_table_name()
+        frames = []
+        directions = []
+        lookup = []
+        animation_count = max(self.animations) + 1
+        for animation_index in xrange(animation_count):
+            animation = self.animations.get(animation_index, None)
+            if not animation:
+                lookup.extend([-1] * DIRECTION_COUNT)
+                continue
+            indexes = {}
+            for direction_index, direction in sorted(animation.iteritems()):
+                if not direction.frames:
+                    # the closest direction with frames is used instead
+                    continue
+                indexes[direction_index] = len(directions)
+                directions.append('{%s, %s, %s, %s, %s, %s}' % (
+                    len(frames), len(direction.frames), direction.min_speed,
+                    direction.max_speed, str(direction.repeat).lower(),
+                    direction.back_to))
+                frames.extend([builder.convert_class_parameter(image)
+                               for image in direction.frames])
+            if not indexes:
+                raise ValueError('animation %s of sprite %s has no frames' % (
+                    animation_index, self.id))
+            for direction_index in xrange(DIRECTION_COUNT):
+                closest = get_closest_direction(indexes, direction_index)
+                lookup.append(indexes[closest])
+        writer.put_line('static Image * %s_frames[] = {%s};' % (
+            name, ', '.join(frames)))
+        writer.put_line('static const AnimationDirection %s_directions[] = '
+            '{%s};' % (name, ', '.join(directions)))
+        writer.put_line('static const short %s_lookup[] = {%s};' % (
+            name, ', '.join([str(item) for item in lookup])))
+        writer.put_line('static const AnimationTable %s_animations = '
+            '{%s_frames, %s_directions, %s_lookup, %s};' % (name, name, name,
+            name, animation_count))
+        writer.put_newline()
+
     def get_parameters(self):
-        return [self.image]
+        return ['&%s_animations' % self.get_table_name()]
 
     def write_init(self, writer):
         pass
@@ -33,4 +152,4 @@ class Sprite(ObjectBase):
         return []
 
 def get_object():
-    return Sprite
\ No newline at end of file
+    return Sprite
@@ -3,88 +3,331 @@
 
 #include "common.h"
 
-/*class Direction
+// Animation data is generated once per object type by the builder as
+// constant tables (see write_tables in edittime.py). Instances only keep
+// indices into them.
+
+#define DIRECTION_COUNT 32
+#define ANIMATION_STEP 100
+
+struct AnimationDirection
 {
-public:
-    int index, min_speed, max_speed, back_to;
+    int frame_start, frame_count;
+    int min_speed, max_speed;
     bool repeat;
-    std::vector<Image*> frames;
+    int back_to;
+};
 
-    Direction(int index, int min_speed, int max_speed, bool repeat, int back_to)
-    : index(index), min_speed(min_speed), max_speed(max_speed), repeat(repeat),
-      back_to(back_to)
-    {
+struct AnimationTable
+{
+    Image ** frames;
+    const AnimationDirection * directions;
+    // animation_count * DIRECTION_COUNT indices into directions, missing
+    // directions are already resolved to the closest one, -1 for missing
+    // animations
+    const short * lookup;
+    int animation_count;
 
+    inline const AnimationDirection * get(int animation, int direction) const
+    {
+        if (animation < 0 || animation >= animation_count)
+            return NULL;
+        int index = lookup[animation * DIRECTION_COUNT + direction];
+        if (index < 0)
+            return NULL;
+        return &directions[index];
     }
 };
 
-class Sprite : public SceneObject
+// Steps the animations of every instance of one sprite type in a scene.
+// Per instance state is packed in parallel arrays so the common case of
+// advancing counters and frames is a branch-free loop the compiler can
+// vectorize. Instances that reach the end of a non-repeating animation
+// are collected in finished for the generated event code.
+
+class Sprite;
+
+class AnimationController : public Controller
 {
 public:
-    std::map<int, std::map<int, Direction*>> animations;
-    Image * image;
+    const AnimationTable * table;
+    std::vector<Sprite*> sprites;
+    std::vector<int> counters;
+    std::vector<int> speeds; // 0 while stopped
+    std::vector<int> frames;
+    std::vector<int> frame_counts;
+    std::vector<int> back_tos; // -1 if not repeating
+    std::vector<Sprite*> finished;
+    // rotated, scaled or mirrored instances get their quad corners
+    // computed in one pass before drawing, 8 floats per slot
+    std::vector<unsigned char> transformed;
+    std::vector<float> quads;
 
-    int animation;
-    unsigned int direction, frame;
-    unsigned int counter;
+    AnimationController(const AnimationTable * table)
+    : table(table)
+    {
+    }
 
-    Sprite(std::string name, int x, int y, int type_id) 
-    : SceneObject(name, x, y, type_id), animation(0), direction(0),
-      frame(0), counter(0)
+    int add(Sprite * sprite, int animation, int direction)
     {
-        create_attributes();
+        int slot = (int)sprites.size();
+        sprites.push_back(sprite);
+        counters.push_back(0);
+        speeds.push_back(0);
+        frames.push_back(0);
+        frame_counts.push_back(0);
+        back_tos.push_back(-1);
+        transformed.push_back(0);
+        set_direction(slot, animation, direction);
+        return slot;
     }
 
-    void add_direction(int animation, int direction,
-                       int min_speed, int max_speed, bool repeat,
-                       int back_to)
+    void remove(int slot);
+    void prepare_draw();
+
+    // sets the animation data for a slot, keeping the current frame if
+    // it is still valid
+    void set_direction(int slot, int animation, int direction)
     {
-        animations[animation][direction] = new Direction(direction, min_speed,
-            max_speed, repeat, back_to);
+        const AnimationDirection * dir = table->get(animation, direction);
+        if (dir == NULL || dir->frame_count <= 0) {
+            speeds[slot] = 0;
+            frame_counts[slot] = 1;
+            frames[slot] = 0;
+            return;
+        }
+        frame_counts[slot] = dir->frame_count;
+        speeds[slot] = dir->frame_count > 1 ? dir->max_speed : 0;
+        if (dir->repeat)
+            back_tos[slot] = dir->back_to < dir->frame_count ? dir->back_to : 0;
+        else
+            back_tos[slot] = -1;
+        if (frames[slot] >= dir->frame_count)
+            frames[slot] = 0;
     }
 
-    void add_image(int animation, int direction, Image * image)
+    void restart(int slot, int animation, int direction)
     {
-        animations[animation][direction]->frames.push_back(image);
+        frames[slot] = 0;
+        counters[slot] = 0;
+        set_direction(slot, animation, direction);
     }
 
     void update(float dt)
     {
-        Direction * dir = animations[animation][direction];
-        counter += dir->max_speed;
-        while (counter > 100) {
-            frame++;
-            if (frame >= dir->frames.size())
-                frame = 0;
-            counter -= 100;
+        finished.clear();
+        int count = (int)sprites.size();
+        if (count == 0)
+            return;
+
+        int * counter = &counters[0];
+        int * frame = &frames[0];
+        const int * speed = &speeds[0];
+        const int * frame_count = &frame_counts[0];
+        int i;
+
+        for (i = 0; i < count; i++) {
+            int value = counter[i] + speed[i];
+            int steps = value / ANIMATION_STEP;
+            counter[i] = value - steps * ANIMATION_STEP;
+            frame[i] += steps;
         }
-    }
 
-    void draw()
-    {
-        glColor4f(1.0, 1.0, 1.0, 1.0);
-        animations[animation][direction]->frames[frame]->draw(x, y);
+        for (i = 0; i < count; i++) {
+            if (frame[i] < frame_count[i])
+                continue;
+            int back_to = back_tos[i];
+            if (back_to >= 0) {
+                frame[i] = back_to + (frame[i] - frame_count[i])
+                           % (frame_count[i] - back_to);
+                continue;
+            }
+            frame[i] = frame_count[i] - 1;
+            counter[i] = 0;
+            speeds[i] = 0;
+            finished.push_back(sprites[i]);
+        }
     }
-};*/
+};
 
 class Sprite : public SceneObject
 {
 public:
-    Image * image;
+    const AnimationTable * animations;
+    int animation, direction;
+    AnimationController * controller;
+    int slot;
+    float angle;
+    float scale_x, scale_y;
+    bool flip_x, flip_y;
 
-    Sprite(Image * image, std::string name, int x, int y, int type_id) 
-    : SceneObject(name, x, y, type_id), image(image)
+    Sprite(const AnimationTable * animations, std::string name, int x, int y,
+           int type_id) 
+    : SceneObject(name, x, y, type_id), animations(animations), animation(0),
+      direction(0), controller(NULL), slot(-1), angle(0.0f), scale_x(1.0f),
+      scale_y(1.0f), flip_x(false), flip_y(false)
     {
         create_attributes();
     }
 
-    void update(float dt)
+    ~Sprite()
+    {
+        if (controller != NULL)
+            controller->remove(slot);
+    }
+
+    void on_add(Scene * scene)
     {
+        controller = (AnimationController*)scene->get_controller(animations);
+        if (controller == NULL) {
+            controller = new AnimationController(animations);
+            scene->add_controller(animations, controller);
+        }
+        slot = controller->add(this, animation, direction);
+        update_transform();
+    }
+
+    bool is_transformed()
+    {
+        return angle != 0.0f || scale_x != 1.0f || scale_y != 1.0f
+               || flip_x || flip_y;
+    }
+
+    void update_transform()
+    {
+        if (controller != NULL)
+            controller->transformed[slot] = is_transformed();
+    }
+
+    void set_angle(float value)
+    {
+        value = fmod(value, 360.0f);
+        if (value < 0.0f)
+            value += 360.0f;
+        angle = value;
+        update_transform();
+    }
+
+    void set_scale(float value)
+    {
+        scale_x = scale_y = value;
+        update_transform();
+    }
+
+    void set_scale(float x_value, float y_value)
+    {
+        scale_x = x_value;
+        scale_y = y_value;
+        update_transform();
+    }
+
+    void set_flip(bool x_value, bool y_value)
+    {
+        flip_x = x_value;
+        flip_y = y_value;
+        update_transform();
+    }
+
+    void set_animation(int value)
+    {
+        if (value == animation || animations->get(value, direction) == NULL)
+            return;
+        animation = value;
+        restart_animation();
+    }
+
+    void set_direction(int value)
+    {
+        value &= DIRECTION_COUNT - 1;
+        if (value == direction)
+            return;
+        direction = value;
+        if (controller != NULL)
+            controller->set_direction(slot, animation, direction);
+    }
+
+    int get_frame()
+    {
+        if (controller == NULL)
+            return 0;
+        return controller->frames[slot];
+    }
+
+    void set_frame(int value)
+    {
+        if (controller == NULL)
+            return;
+        int count = controller->frame_counts[slot];
+        controller->frames[slot] = std::max<int>(0,
+            std::min<int>(value, count - 1));
+    }
+
+    void restart_animation()
+    {
+        if (controller != NULL)
+            controller->restart(slot, animation, direction);
+    }
+
+    Image * get_image()
+    {
+        const AnimationDirection * dir = animations->get(animation, direction);
+        if (dir == NULL)
+            return NULL;
+        return animations->frames[dir->frame_start + get_frame()];
     }
 
     void draw()
     {
+        Image * image = get_image();
+        if (image == NULL)
+            return;
         glColor4f(1.0, 1.0, 1.0, 1.0);
-        image->draw(x, y);
+        if (controller != NULL && controller->transformed[slot])
+            image->draw(&controller->quads[slot * 8]);
+        else
+            image->draw(x, y);
+    }
+};
+
+inline void AnimationController::remove(int slot)
+{
+    int last = (int)sprites.size() - 1;
+    if (slot != last) {
+        sprites[slot] = sprites[last];
+        counters[slot] = counters[last];
+        speeds[slot] = speeds[last];
+        frames[slot] = frames[last];
+        frame_counts[slot] = frame_counts[last];
+        back_tos[slot] = back_tos[last];
+        transformed[slot] = transformed[last];
+        sprites[slot]->slot = slot;
+    }
+    sprites.pop_back();
+    counters.pop_back();
+    speeds.pop_back();
+    frames.pop_back();
+    frame_counts.pop_back();
+    back_tos.pop_back();
+    transformed.pop_back();
+}
+
+inline void AnimationController::prepare_draw()
+{
+    int count = (int)sprites.size();
+    quads.resize(count * 8);
+    for (int i = 0; i < count; i++) {
+        if (!transformed[i])
+            continue;
+        Sprite * sprite = sprites[i];
+        Image * image = sprite->get_image();
+        if (image == NULL)
+            continue;
+        image->load();
+        float sin_value, cos_value;
+        get_sin_cos(sprite->angle, sin_value, cos_value);
+        float scale_x = sprite->flip_x ? -sprite->scale_x : sprite->scale_x;
+        float scale_y = sprite->flip_y ? -sprite->scale_y : sprite->scale_y;
+        image->get_corners((float)sprite->x, (float)sprite->y, cos_value,
+                           sin_value, scale_x, scale_y, &quads[i * 8]);
     }
-};
\ No newline at end of file
+}
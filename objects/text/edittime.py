@@ -0,0 +1,103 @@
+# Copyright (c) Mathias Kaerlev
+# See LICENSE for details.
+
+import os
+from chowdren.object import ObjectBase
+from chowdren.font import Font
+from chowdren.common import make_color
+from PySide.QtGui import QColor, QFont, QFontDatabase, QFontMetrics
+
+class Text(ObjectBase):
+    runtime_sources = ['font.cpp']
+
+    actions = {
+        'set_text' : '{instance}->set_text({0})'
+    }
+
+    def initialize(self):
+        self.text = 'Text'
+        self.font_file = ''
+        self.size = 12
+        self.color = (0, 0, 0)
+        self.bake = True
+
+    def read(self, data):
+        self.text = data['text']
+        self.font_file = data['font']
+        self.size = data['size']
+        self.color = data['color']
+        self.bake = data.get('bake', True)
+
+    def write(self, data):
+        data['text'] = self.text
+        data['font'] = self.font_file
+        data['size'] = self.size
+        data['color'] = self.color
+        data['bake'] = self.bake
+
+    def get_font(self):
+        return Font(self.font_file, self.size)
+
+    def get_qt_font(self):
+        font = QFont()
+        if self.font_file:
+            font_id = QFontDatabase.addApplicationFont(self.font_file)
+            families = QFontDatabase.applicationFontFamilies(font_id)
+            if families:
+                font = QFont(families[0])
+        font.setPointSize(self.size)
+        return font
+
+    def get_bounding_box(self):
+        metrics = QFontMetrics(self.get_qt_font())
+        rect = metrics.boundingRect(0, 0, 0, 0, 0, self.text)
+        return (0, 0, max(1, rect.width()), max(1, rect.height()))
+
+    def draw(self, painter):
+        painter.setFont(self.get_qt_font())
+        painter.setPen(QColor(*self.color))
+        x, y, width, height = self.get_bounding_box()
+        painter.drawText(x, y, width, height, 0, self.text)
+
+    # for runtime
+
+    def get_font_path(self):
+        return 'fonts/%s' % os.path.basename(self.font_file)
+
+    def check_font_file(self):
+        # neither the baker nor FreeType has a font to fall back on
+        if not self.font_file:
+            raise ValueError('Text object %s has no font file' % self.id)
+
+    def get_fonts(self):
+        self.check_font_file()
+        if not self.bake:
+            return []
+        return [(self.get_font(), self.text)]
+
+    def get_parameters(self):
+        self.check_font_file()
+        if self.bake:
+            baked = self.get_font()
+        else:
+            baked = 'NULL'
+        text = self.text.encode('utf-8').replace('\\', '\\\\').replace(
+            '"', '\\"').replace('\n', '\\n')
+        return ['"./%s"' % self.get_font_path(), self.size, baked,
+                make_color(self.color), '"%s"' % text]
+
+    def get_runtime_files(self):
+        # the FreeType path loads the font file at runtime
+        self.check_font_file()
+        if self.bake:
+            return []
+        return [(self.font_file, self.get_font_path())]
+
+    def write_init(self, writer):
+        pass
+
+    def get_init_list(self):
+        return []
+
+def get_object():
+    return Text
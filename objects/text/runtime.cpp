@@ -0,0 +1,190 @@
+// Copyright (c) Mathias Kaerlev
+// See LICENSE for details.
+
+#include "common.h"
+#include "font.h"
+
+// fonts are shared between all Text instances using the same file and size
+
+inline FTTextureFont * get_texture_font(const std::string & filename, int size)
+{
+    static std::map<std::pair<std::string, int>, FTTextureFont*> fonts;
+    std::pair<std::string, int> key(filename, size);
+    std::map<std::pair<std::string, int>, FTTextureFont*>::iterator it =
+        fonts.find(key);
+    if (it != fonts.end())
+        return it->second;
+    FTTextureFont * font = new FTTextureFont(filename.c_str(), false);
+    if (font->err != 0) {
+        printf("Could not load %s\n", filename.c_str());
+        delete font;
+        font = NULL;
+    } else
+        font->FaceSize(size, 72);
+    fonts[key] = font;
+    return font;
+}
+
+struct TextGlyph
+{
+    FTGlyph * glyph;
+    const BakedGlyph * baked;
+    float x, y;
+};
+
+class Text : public SceneObject
+{
+public:
+    FTTextureFont * font;
+    BakedFont * baked_font;
+    std::string text;
+    Color color;
+    // glyphs and pen positions relative to (x, y), rebuilt only when the
+    // text changes
+    std::vector<TextGlyph> layout;
+    bool layout_dirty;
+
+    Text(std::string font_file, int size, BakedFont * baked_font,
+         Color color, std::string text, std::string name,
+         int x, int y, int type_id)
+    : SceneObject(name, x, y, type_id), font(NULL), baked_font(baked_font),
+      text(text), color(color), layout_dirty(true)
+    {
+        if (baked_font == NULL)
+            font = get_texture_font(font_file, size);
+    }
+
+    void set_text(const std::string & value)
+    {
+        if (value == text)
+            return;
+        text = value;
+        layout_dirty = true;
+    }
+
+    void set_text(const char * value)
+    {
+        // assign() reuses the string buffer, so timers and counters that
+        // are set every frame do not allocate
+        if (text.compare(value) == 0)
+            return;
+        text.assign(value);
+        layout_dirty = true;
+    }
+
+    void update_layout()
+    {
+        layout_dirty = false;
+        layout.clear();
+        if (baked_font != NULL)
+            layout_baked();
+        else if (font != NULL)
+            layout_texture();
+    }
+
+    void layout_texture()
+    {
+        float line_height = font->LineHeight();
+        float pen_x = 0.0f;
+        float pen_y = font->Ascender();
+        FTUnicodeStringItr<unsigned char> ustr(
+            (const unsigned char *)text.c_str());
+        while (*ustr) {
+            unsigned int c = *ustr++;
+            unsigned int next = *ustr;
+            if (c == '\n') {
+                pen_x = 0.0f;
+                pen_y += line_height;
+                continue;
+            }
+            if (!font->CheckGlyph(c))
+                continue;
+            TextGlyph item;
+            item.glyph = font->glyphList->Glyph(c);
+            item.baked = NULL;
+            item.x = pen_x;
+            item.y = pen_y;
+            layout.push_back(item);
+            pen_x += font->glyphList->Advance(c, next);
+        }
+    }
+
+    void layout_baked()
+    {
+        baked_font->load();
+        float pen_x = 0.0f;
+        float pen_y = baked_font->ascender;
+        const BakedGlyph * last = NULL;
+        const char * str = text.c_str();
+        while (*str != 0) {
+            unsigned int c = BakedFont::decode_utf8(str);
+            if (c == '\n') {
+                pen_x = 0.0f;
+                pen_y += baked_font->line_height;
+                last = NULL;
+                continue;
+            }
+            const BakedGlyph * glyph = baked_font->get_glyph(c);
+            if (glyph == NULL)
+                continue;
+            pen_x += baked_font->get_kerning(last, glyph);
+            TextGlyph item;
+            item.glyph = NULL;
+            item.baked = glyph;
+            item.x = pen_x;
+            item.y = pen_y;
+            layout.push_back(item);
+            pen_x += glyph->advance;
+            last = glyph;
+        }
+    }
+
+    void draw()
+    {
+        if (layout_dirty)
+            update_layout();
+        if (layout.empty())
+            return;
+        glColor4f(color.r, color.g, color.b, color.a);
+        if (baked_font != NULL)
+            draw_baked();
+        else
+            draw_texture();
+    }
+
+    void draw_texture()
+    {
+        glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_TEXTURE_BIT);
+        glEnable(GL_TEXTURE_2D);
+        glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+        FTTextureGlyph::ResetActiveTexture();
+        // FTGL glyphs are laid out with y pointing up
+        glPushMatrix();
+        glTranslated(x, y, 0.0);
+        glScalef(1.0f, -1.0f, 1.0f);
+        for (std::vector<TextGlyph>::const_iterator it = layout.begin();
+             it != layout.end(); it++) {
+            it->glyph->Render(FTPoint(it->x, -it->y), RENDER_ALL);
+        }
+        glPopMatrix();
+        glPopAttrib();
+    }
+
+    void draw_baked()
+    {
+        if (baked_font->tex == 0)
+            return;
+        glEnable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, baked_font->tex);
+        glBegin(GL_QUADS);
+        float base_x = (float)x;
+        float base_y = (float)y;
+        for (std::vector<TextGlyph>::const_iterator it = layout.begin();
+             it != layout.end(); it++) {
+            baked_font->draw_glyph(it->baked, base_x + it->x,
+                                   base_y + it->y);
+        }
+        glEnd();
+        glDisable(GL_TEXTURE_2D);
+    }
+};
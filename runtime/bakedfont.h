@@ -0,0 +1,250 @@
+// Copyright (c) Mathias Kaerlev
+// See LICENSE for details.
+
+#ifndef BAKEDFONT_H
+#define BAKEDFONT_H
+
+// Fonts baked by the builder (see chowdren/font.py). Glyphs are read from
+// an atlas image and a binary metrics table, FreeType is not involved.
+
+#define BAKED_FONT_MAGIC 0x42464843
+#define BAKED_FONT_VERSION 2
+
+// must match PAGE_BITS in chowdren/font.py
+#define BAKED_PAGE_BITS 8
+#define BAKED_PAGE_SIZE (1 << BAKED_PAGE_BITS)
+#define BAKED_PAGE_MASK (BAKED_PAGE_SIZE - 1)
+#define BAKED_UNICODE_LIMIT 0x110000
+#define BAKED_PAGE_COUNT (BAKED_UNICODE_LIMIT >> BAKED_PAGE_BITS)
+#define BAKED_NO_PAGE 0xFFFFFFFF
+
+struct BakedGlyph
+{
+    unsigned int code;
+    float advance;
+    float left, top, width, height;
+    float u0, v0, u1, v1;
+};
+
+struct BakedKerning
+{
+    unsigned int left, right;
+    float x;
+
+    bool operator<(const BakedKerning & other) const
+    {
+        if (left != other.left)
+            return left < other.left;
+        return right < other.right;
+    }
+};
+
+class BakedFont
+{
+public:
+    std::string filename;
+    bool loaded;
+    GLuint tex;
+    int width, height;
+    float size, ascender, descender, line_height;
+    std::vector<BakedGlyph> glyphs;
+    std::vector<BakedKerning> kerning;
+    std::vector<unsigned int> charmap;
+
+    BakedFont(std::string name)
+    : loaded(false), tex(0), width(0), height(0), size(0.0f),
+      ascender(0.0f), descender(0.0f), line_height(0.0f)
+    {
+        filename = "./fonts/" + name;
+    }
+
+    void load()
+    {
+        if (loaded)
+            return;
+        loaded = true;
+        if (!read_metrics()) {
+            printf("Could not load %s.dat\n", filename.c_str());
+            glyphs.clear();
+            kerning.clear();
+            charmap.clear();
+            return;
+        }
+        int atlas_width, atlas_height;
+        load_texture((filename + ".png").c_str(), 4, 0, 0,
+            &tex, &atlas_width, &atlas_height);
+        if (tex == 0)
+            printf("Could not load %s.png\n", filename.c_str());
+    }
+
+    // returns the glyph for a code point or NULL if it was not baked
+    inline const BakedGlyph * get_glyph(unsigned int c) const
+    {
+        if (c >= BAKED_UNICODE_LIMIT || charmap.empty())
+            return NULL;
+        unsigned int page = charmap[1 + (c >> BAKED_PAGE_BITS)];
+        if (page == BAKED_NO_PAGE)
+            return NULL;
+        unsigned int index = charmap[1 + BAKED_PAGE_COUNT + page
+                                     + (c & BAKED_PAGE_MASK)];
+        if (index == 0)
+            return NULL;
+        return &glyphs[index - 1];
+    }
+
+    inline float get_kerning(const BakedGlyph * left,
+                             const BakedGlyph * right) const
+    {
+        if (kerning.empty() || left == NULL || right == NULL)
+            return 0.0f;
+        BakedKerning key;
+        key.left = (unsigned int)(left - &glyphs[0]);
+        key.right = (unsigned int)(right - &glyphs[0]);
+        std::vector<BakedKerning>::const_iterator it = std::lower_bound(
+            kerning.begin(), kerning.end(), key);
+        if (it == kerning.end() || it->left != key.left ||
+            it->right != key.right)
+            return 0.0f;
+        return it->x;
+    }
+
+    float get_advance(const char * text, int len = -1)
+    {
+        load();
+        float advance = 0.0f;
+        const BakedGlyph * last = NULL;
+        const char * end = len < 0 ? NULL : text + len;
+        while (end == NULL ? *text != 0 : text < end) {
+            const BakedGlyph * glyph = get_glyph(decode_utf8(text));
+            if (glyph == NULL)
+                continue;
+            advance += get_kerning(last, glyph) + glyph->advance;
+            last = glyph;
+        }
+        return advance;
+    }
+
+    // draws text with the baseline starting at (x, y)
+    void draw(const char * text, double x, double y, int len = -1)
+    {
+        load();
+        if (tex == 0)
+            return;
+
+        glEnable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, tex);
+        glBegin(GL_QUADS);
+        float pen = (float)x;
+        const BakedGlyph * last = NULL;
+        const char * end = len < 0 ? NULL : text + len;
+        while (end == NULL ? *text != 0 : text < end) {
+            const BakedGlyph * glyph = get_glyph(decode_utf8(text));
+            if (glyph == NULL)
+                continue;
+            pen += get_kerning(last, glyph);
+            draw_glyph(glyph, pen, (float)y);
+            pen += glyph->advance;
+            last = glyph;
+        }
+        glEnd();
+        glDisable(GL_TEXTURE_2D);
+    }
+
+    // emits one quad, must be called between glBegin(GL_QUADS)/glEnd()
+    inline void draw_glyph(const BakedGlyph * glyph, float x, float y) const
+    {
+        float x1 = floor(x + glyph->left);
+        float y1 = floor(y - glyph->top);
+        float x2 = x1 + glyph->width;
+        float y2 = y1 + glyph->height;
+        glTexCoord2f(glyph->u0, glyph->v0);
+        glVertex2f(x1, y1);
+        glTexCoord2f(glyph->u1, glyph->v0);
+        glVertex2f(x2, y1);
+        glTexCoord2f(glyph->u1, glyph->v1);
+        glVertex2f(x2, y2);
+        glTexCoord2f(glyph->u0, glyph->v1);
+        glVertex2f(x1, y2);
+    }
+
+    // reads one code point and advances the pointer, invalid sequences
+    // are returned byte by byte
+    static inline unsigned int decode_utf8(const char *& text)
+    {
+        const unsigned char * p = (const unsigned char *)text;
+        unsigned int c = *p;
+        int extra = 0;
+        if (c >= 0xF0 && c < 0xF8) {
+            c &= 0x07;
+            extra = 3;
+        } else if (c >= 0xE0) {
+            c &= 0x0F;
+            extra = 2;
+        } else if (c >= 0xC0) {
+            c &= 0x1F;
+            extra = 1;
+        }
+        for (int i = 1; i <= extra; i++) {
+            if ((p[i] & 0xC0) != 0x80) {
+                text++;
+                return *p;
+            }
+            c = (c << 6) | (p[i] & 0x3F);
+        }
+        text += extra + 1;
+        return c;
+    }
+
+private:
+    bool read_metrics()
+    {
+        FILE * fp = fopen((filename + ".dat").c_str(), "rb");
+        if (fp == NULL)
+            return false;
+        bool ret = read_metrics(fp);
+        fclose(fp);
+        return ret;
+    }
+
+    bool read_metrics(FILE * fp)
+    {
+        unsigned int header[2];
+        if (fread(header, sizeof(header), 1, fp) != 1
+            || header[0] != BAKED_FONT_MAGIC
+            || header[1] != BAKED_FONT_VERSION)
+            return false;
+        float values[4];
+        if (fread(values, sizeof(values), 1, fp) != 1)
+            return false;
+        size = values[0];
+        ascender = values[1];
+        descender = values[2];
+        line_height = values[3];
+        unsigned int counts[3];
+        if (fread(counts, sizeof(counts), 1, fp) != 1)
+            return false;
+        width = counts[0];
+        height = counts[1];
+        glyphs.resize(counts[2]);
+        if (!glyphs.empty() && fread(&glyphs[0], sizeof(BakedGlyph),
+                                     glyphs.size(), fp) != glyphs.size())
+            return false;
+        unsigned int count;
+        if (fread(&count, sizeof(count), 1, fp) != 1)
+            return false;
+        kerning.resize(count);
+        if (count > 0 && fread(&kerning[0], sizeof(BakedKerning), count,
+                               fp) != count)
+            return false;
+        if (fread(&count, sizeof(count), 1, fp) != 1)
+            return false;
+        charmap.resize(1 + BAKED_PAGE_COUNT + count);
+        charmap[0] = count;
+        if (fread(&charmap[1], sizeof(unsigned int), charmap.size() - 1,
+                  fp) != charmap.size() - 1)
+            return false;
+        return true;
+    }
+};
+
+#endif // BAKEDFONT_H
@@ -4,16 +4,9 @@
 #ifndef COMMON_H
 #define COMMON_H
 
-#include "SOIL.h"
-#include <string>
-#include <list>
-#include <vector>
-#include <map>
-#include <iostream>
-#include <sstream>
-#include <algorithm>
-#include <GL/glfw.h>
-#include <stdlib.h>
+#include "pch.h"
+
+class GameManager;
 
 class Color
 {
@@ -67,7 +60,7 @@ public:
     Sound(char * name) : name(name) {}
 };
 
-void load_texture(const char *filename, int force_channels, 
+inline void load_texture(const char *filename, int force_channels, 
                   unsigned int reuse_texture_ID, unsigned int flags,
                   GLuint * tex, int * width, int * height)
 {
@@ -99,11 +92,18 @@ class Image
 public:
     std::string filename;
     int hotspot_x, hotspot_y, action_x, action_y;
+    // the builder cuts off transparent borders, so the file only holds the
+    // trim_width x trim_height pixels at (trim_x, trim_y). width and height
+    // are the full canvas, which the hotspot is relative to
+    int trim_x, trim_y, trim_width, trim_height;
     GLuint tex;
     int width, height;
 
-    Image(std::string name, int hot_x, int hot_y) 
-    : hotspot_x(hot_x), hotspot_y(hot_y), tex(0)
+    Image(std::string name, int hot_x, int hot_y, int trim_x, int trim_y,
+          int trim_width, int trim_height, int width, int height)
+    : hotspot_x(hot_x), hotspot_y(hot_y), trim_x(trim_x), trim_y(trim_y),
+      trim_width(trim_width), trim_height(trim_height), tex(0),
+      width(width), height(height)
     {
         filename = "./images/" + name + ".png";
     }
@@ -112,35 +112,129 @@ public:
     {
         if (tex != 0)
             return;
+        int file_width, file_height;
         load_texture(filename.c_str(), 4, 0, SOIL_FLAG_POWER_OF_TWO,
-            &tex, &width, &height);
+            &tex, &file_width, &file_height);
         if (tex == 0) {
             printf("Could not load %s\n", filename.c_str());
         }
     }
 
+    // writes the 4 corners (x, y pairs) of the trimmed image drawn at
+    // (x, y) scaled around its hotspot, then rotated by (cos_a, sin_a).
+    // negative scales mirror the image.
+    inline void get_corners(float x, float y, float cos_a, float sin_a,
+                            float scale_x, float scale_y, float * out)
+    {
+        float x1 = (trim_x - hotspot_x) * scale_x;
+        float y1 = (trim_y - hotspot_y) * scale_y;
+        float x2 = (trim_x + trim_width - hotspot_x) * scale_x;
+        float y2 = (trim_y + trim_height - hotspot_y) * scale_y;
+        // y points down, so positive angles turn counter-clockwise
+        out[0] = x + x1 * cos_a + y1 * sin_a;
+        out[1] = y - x1 * sin_a + y1 * cos_a;
+        out[2] = x + x2 * cos_a + y1 * sin_a;
+        out[3] = y - x2 * sin_a + y1 * cos_a;
+        out[4] = x + x2 * cos_a + y2 * sin_a;
+        out[5] = y - x2 * sin_a + y2 * cos_a;
+        out[6] = x + x1 * cos_a + y2 * sin_a;
+        out[7] = y - x1 * sin_a + y2 * cos_a;
+    }
+
+    // draws the image into corners from get_corners()
+    void draw(const float * corners)
+    {
+        load();
+
+        glEnable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, tex);
+        glBegin(GL_QUADS);
+        glTexCoord2f(0.0, 0.0);
+        glVertex2f(corners[0], corners[1]);
+        glTexCoord2f(1.0, 0.0);
+        glVertex2f(corners[2], corners[3]);
+        glTexCoord2f(1.0, 1.0);
+        glVertex2f(corners[4], corners[5]);
+        glTexCoord2f(0.0, 1.0);
+        glVertex2f(corners[6], corners[7]);
+        glEnd();
+        glDisable(GL_TEXTURE_2D);
+    }
+
     void draw(double x, double y)
     {
         load();
 
-        x -= (double)hotspot_x;
-        y -= (double)hotspot_y;
+        x += (double)(trim_x - hotspot_x);
+        y += (double)(trim_y - hotspot_y);
         glEnable(GL_TEXTURE_2D);
         glBindTexture(GL_TEXTURE_2D, tex);
         glBegin(GL_QUADS);
         glTexCoord2f(0.0, 0.0);
         glVertex2d(x, y);
         glTexCoord2f(1.0, 0.0);
-        glVertex2d(x + width, y);
+        glVertex2d(x + trim_width, y);
         glTexCoord2f(1.0, 1.0);
-        glVertex2d(x + width, y + height);
+        glVertex2d(x + trim_width, y + trim_height);
         glTexCoord2f(0.0, 1.0);
-        glVertex2d(x, y + height);
+        glVertex2d(x, y + trim_height);
         glEnd();
         glDisable(GL_TEXTURE_2D);
     }
 };
 
+#include "bakedfont.h"
+
+// sin/cos for whole degrees come from a table, so the usual 0/90/45 etc.
+// angles cost a lookup
+
+class SinCosTable
+{
+public:
+    float sin_values[360];
+    float cos_values[360];
+
+    SinCosTable()
+    {
+        for (int i = 0; i < 360; i++) {
+            double radians = i * (3.14159265358979323846 / 180.0);
+            sin_values[i] = (float)sin(radians);
+            cos_values[i] = (float)cos(radians);
+        }
+    }
+};
+
+// defined in run.cpp
+extern SinCosTable sin_cos_table;
+
+inline void get_sin_cos(float degrees, float & sin_value, float & cos_value)
+{
+    int whole = (int)degrees;
+    if ((float)whole == degrees) {
+        whole %= 360;
+        if (whole < 0)
+            whole += 360;
+        sin_value = sin_cos_table.sin_values[whole];
+        cos_value = sin_cos_table.cos_values[whole];
+        return;
+    }
+    float radians = degrees * (3.14159265358979323846f / 180.0f);
+    sin_value = (float)sin(radians);
+    cos_value = (float)cos(radians);
+}
+
+// keyboard state, kept from key events instead of polled from GLFW so
+// that recorded input plays back the same way (see record.h)
+
+// defined in run.cpp
+extern unsigned char key_states[GLFW_KEY_LAST + 1];
+
+inline bool is_key_down(int key)
+{
+    if (key < 0 || key > GLFW_KEY_LAST)
+        return false;
+    return key_states[key] != 0;
+}
 
 // object types
 
@@ -167,6 +261,58 @@ public:
 typedef Attributes<double> AttributeValues;
 typedef Attributes<std::string> AttributeStrings;
 
+// movement data written by the builder, see movement.h
+
+enum MovementType
+{
+    MOVEMENT_BALL,
+    MOVEMENT_EIGHT_DIRECTIONS,
+    MOVEMENT_PATH
+};
+
+struct PathNode
+{
+    float x, y;
+};
+
+struct MovementInfo
+{
+    int type;
+    float speed; // pixels per second
+    float angle; // initial ball direction in degrees
+    bool bounce; // ball bounces off the scene edges
+    const PathNode * nodes; // relative to the start position
+    int node_count;
+    bool loop;
+    float path_length;
+};
+
+class Scene;
+
+// events with a trigger condition run from handle_events() once per queued
+// Trigger instead of being tested every tick. see chowdren/events.py
+
+enum TriggerType
+{
+    TRIGGER_START_OF_SCENE,
+    TRIGGER_KEY_PRESSED,
+    TRIGGER_KEY_RELEASED,
+    // pushed by SceneObject::changed() with the object and its type id
+    TRIGGER_POSITION_CHANGED,
+    TRIGGER_VALUE_CHANGED
+};
+
+class SceneObject;
+
+struct Trigger
+{
+    int type;
+    int parameter;
+    SceneObject * object;
+};
+
+typedef std::vector<Trigger> TriggerQueue;
+
 class SceneObject
 {
 public:
@@ -175,28 +321,58 @@ public:
     int id;
     AttributeValues * attribute_values;
     AttributeStrings * attribute_strings;
+    const MovementInfo * movement;
+    Scene * scene;
+    // draw order: by layer, then z, then creation order (draw_index)
+    int layer, z;
+    unsigned int draw_index;
+    int batch_key;
+    bool depth_changed;
+    // (1 << TriggerType) bits of the changes events listen for on this
+    // type, and of the ones already queued since the last handle_events()
+    unsigned int watch_mask, pending_mask;
 
     SceneObject(std::string name, int x, int y, int type_id) 
-    : name(name), x(x), y(y), id(type_id)
+    : name(name), x(x), y(y), id(type_id), movement(NULL), scene(NULL),
+      layer(0), z(0), draw_index(0), batch_key(0), depth_changed(false),
+      watch_mask(0), pending_mask(0)
     {
     }
 
     void set_position(double x, double y)
     {
+        if (x == this->x && y == this->y)
+            return;
         this->x = x;
         this->y = y;
+        changed(TRIGGER_POSITION_CHANGED);
     }
 
     void set_x(double x)
     {
-        this->x = x;
+        set_position(x, y);
     }
 
     void set_y(double y)
     {
-        this->y = y;
+        set_position(x, y);
+    }
+
+    // objects nobody listens to only pay for the mask test
+    inline void changed(int trigger_type)
+    {
+        unsigned int flag = 1 << trigger_type;
+        if ((watch_mask & flag) == 0 || (pending_mask & flag) != 0)
+            return;
+        pending_mask |= flag;
+        notify(trigger_type);
     }
 
+    void notify(int trigger_type);
+
+    void set_layer(int layer);
+    void set_z(int z);
+
     void create_attributes()
     {
         attribute_values = new AttributeValues;
@@ -205,10 +381,57 @@ public:
 
     virtual void draw() {}
     virtual void update(float dt) {}
+    virtual void on_add(Scene * scene) {}
 };
 
 typedef std::vector<SceneObject*> ObjectList;
 
+struct DepthCompare
+{
+    bool operator()(const SceneObject * a, const SceneObject * b) const
+    {
+        if (a->layer != b->layer)
+            return a->layer < b->layer;
+        if (a->z != b->z)
+            return a->z < b->z;
+        if (a->batch_key != b->batch_key)
+            return a->batch_key < b->batch_key;
+        return a->draw_index < b->draw_index;
+    }
+};
+
+inline bool has_depth_changed(const SceneObject * object)
+{
+    return object->depth_changed;
+}
+
+// Controllers step every object of one kind in a single pass per tick,
+// instead of each object doing the work in its own update()
+
+class Controller
+{
+public:
+    virtual ~Controller() {}
+    virtual void update(float dt) = 0;
+    // called once per frame before any object is drawn
+    virtual void prepare_draw() {}
+};
+
+typedef std::vector<Controller*> ControllerList;
+
+inline void add_movement(Scene * scene, SceneObject * object);
+
+// state of a named loop. names are resolved to slots in Scene::loops by the
+// builder
+
+struct Loop
+{
+    int index;
+    bool running;
+};
+
+typedef std::vector<Loop> LoopList;
+
 class Scene
 {
 public:
@@ -218,21 +441,72 @@ public:
     GameManager * manager;
     ObjectList instances;
     std::map<int, ObjectList> instance_classes;
+    // instances in draw order. objects added or given a new layer/z wait in
+    // depth_changed and are merged back in before the next draw
+    ObjectList draw_list;
+    ObjectList depth_changed;
+    unsigned int next_draw_index;
+    // layers where objects of the same z are grouped by type, so objects
+    // sharing textures are drawn back to back
+    std::vector<bool> batch_layers;
+    ControllerList controllers;
+    std::map<const void*, Controller*> controller_keys;
+    // SceneObject::watch_mask for each object type id
+    std::vector<unsigned int> watch_masks;
+    LoopList loops;
+    // loop name -> slot in loops, for debugging only
     std::map<std::string, int> loop_indexes;
+    TriggerQueue triggers;
     Color background_color;
 
     Scene(std::string name, int width, int height, Color background_color,
           int index, GameManager * manager)
     : name(name), width(width), height(height), index(index), 
-      background_color(background_color), manager(manager)
+      background_color(background_color), manager(manager),
+      next_draw_index(0)
     {}
 
     virtual void on_start() {}
     virtual void on_end() {}
-    virtual void handle_events() {}
+    virtual void handle_events()
+    {
+        clear_triggers();
+    }
+
+    void push_trigger(int type, int parameter = 0,
+                      SceneObject * object = NULL)
+    {
+        Trigger trigger;
+        trigger.type = type;
+        trigger.parameter = parameter;
+        trigger.object = object;
+        triggers.push_back(trigger);
+    }
+
+    void clear_triggers()
+    {
+        for (TriggerQueue::const_iterator iter = triggers.begin(); 
+             iter != triggers.end(); iter++) {
+            if (iter->object != NULL)
+                iter->object->pending_mask = 0;
+        }
+        triggers.clear();
+    }
+
+    void watch(int type_id, int trigger_type)
+    {
+        if (type_id >= (int)watch_masks.size())
+            watch_masks.resize(type_id + 1, 0);
+        watch_masks[type_id] |= 1 << trigger_type;
+    }
 
     void update(float dt)
     {
+        for (ControllerList::const_iterator iter = controllers.begin(); 
+             iter != controllers.end(); iter++) {
+            (*iter)->update(dt);
+        }
+
         for (ObjectList::const_iterator iter = instances.begin(); 
              iter != instances.end(); iter++) {
             (*iter)->update(dt);
@@ -255,13 +529,84 @@ public:
                      background_color.a);
         glClear(GL_COLOR_BUFFER_BIT);
 
-        for (ObjectList::const_iterator iter = instances.begin(); 
-             iter != instances.end(); iter++) {
+        for (ControllerList::const_iterator iter = controllers.begin(); 
+             iter != controllers.end(); iter++) {
+            (*iter)->prepare_draw();
+        }
+
+        update_draw_list();
+        for (ObjectList::const_iterator iter = draw_list.begin(); 
+             iter != draw_list.end(); iter++) {
             (*iter)->draw();
         }
 
     }
 
+    void mark_depth_changed(SceneObject * object)
+    {
+        if (object->depth_changed)
+            return;
+        object->depth_changed = true;
+        depth_changed.push_back(object);
+    }
+
+    void update_draw_list()
+    {
+        if (depth_changed.empty())
+            return;
+        // take the changed objects out, keeping the rest in order, then
+        // merge them back in sorted. only the changed objects get sorted
+        draw_list.erase(std::remove_if(draw_list.begin(), draw_list.end(),
+            has_depth_changed), draw_list.end());
+        for (ObjectList::const_iterator iter = depth_changed.begin(); 
+             iter != depth_changed.end(); iter++) {
+            SceneObject * object = *iter;
+            object->depth_changed = false;
+            if (is_batch_layer(object->layer))
+                object->batch_key = object->id;
+            else
+                object->batch_key = 0;
+        }
+        std::sort(depth_changed.begin(), depth_changed.end(), DepthCompare());
+        size_t middle = draw_list.size();
+        draw_list.insert(draw_list.end(), depth_changed.begin(),
+                         depth_changed.end());
+        std::inplace_merge(draw_list.begin(), draw_list.begin() + middle,
+                           draw_list.end(), DepthCompare());
+        depth_changed.clear();
+    }
+
+    bool is_batch_layer(int layer)
+    {
+        return layer >= 0 && layer < (int)batch_layers.size() &&
+               batch_layers[layer];
+    }
+
+    void set_layer_batching(int layer, bool value)
+    {
+        if (layer < 0)
+            return;
+        if (layer >= (int)batch_layers.size())
+            batch_layers.resize(layer + 1, false);
+        if (batch_layers[layer] == value)
+            return;
+        batch_layers[layer] = value;
+        for (ObjectList::const_iterator iter = draw_list.begin(); 
+             iter != draw_list.end(); iter++) {
+            if ((*iter)->layer == layer)
+                mark_depth_changed(*iter);
+        }
+    }
+
+    int get_loop_index(const std::string & name)
+    {
+        std::map<std::string, int>::const_iterator it =
+            loop_indexes.find(name);
+        if (it == loop_indexes.end())
+            return 0;
+        return loops[it->second].index;
+    }
+
     ObjectList & get_instances(int object_id)
     {
         return instance_classes[object_id];
@@ -272,10 +617,42 @@ public:
         return *instance_classes[object_id][0];
     }
 
+    void add_object(SceneObject * object, int layer, int z)
+    {
+        object->layer = layer;
+        object->z = z;
+        add_object(object);
+    }
+
     void add_object(SceneObject * object)
     {
+        object->scene = this;
+        object->draw_index = next_draw_index++;
+        if (object->id >= 0 && object->id < (int)watch_masks.size())
+            object->watch_mask = watch_masks[object->id];
+        mark_depth_changed(object);
         instances.push_back(object);
         instance_classes[object->id].push_back(object);
+        if (object->movement != NULL)
+            add_movement(this, object);
+        object->on_add(this);
+    }
+
+    // controllers are looked up by a key shared by the objects they step,
+    // e.g. the constant data of an object type
+    Controller * get_controller(const void * key)
+    {
+        std::map<const void*, Controller*>::const_iterator it =
+            controller_keys.find(key);
+        if (it == controller_keys.end())
+            return NULL;
+        return it->second;
+    }
+
+    void add_controller(const void * key, Controller * controller)
+    {
+        controller_keys[key] = controller;
+        controllers.push_back(controller);
     }
 
     ObjectList create_object(SceneObject * object)
@@ -287,9 +664,87 @@ public:
     }
 };
 
-static ObjectList::iterator item;
+inline void SceneObject::notify(int trigger_type)
+{
+    if (scene != NULL)
+        scene->push_trigger(trigger_type, id, this);
+}
+
+inline void SceneObject::set_layer(int layer)
+{
+    if (layer == this->layer)
+        return;
+    this->layer = layer;
+    if (scene != NULL)
+        scene->mark_depth_changed(this);
+}
+
+inline void SceneObject::set_z(int z)
+{
+    if (z == this->z)
+        return;
+    this->z = z;
+    if (scene != NULL)
+        scene->mark_depth_changed(this);
+}
+
+// object groups are written by the builder as constant type id tables.
+// GroupIterator walks the instances of each member type in turn, so no
+// merged list is ever built
+
+struct ObjectGroup
+{
+    const int * types;
+    int count;
+};
+
+class GroupIterator
+{
+public:
+    Scene * scene;
+    const ObjectGroup & group;
+    int type_index;
+    ObjectList * list;
+    size_t index;
+
+    GroupIterator(Scene * scene, const ObjectGroup & group)
+    : scene(scene), group(group), type_index(-1), list(NULL), index(0)
+    {
+        next_list();
+    }
+
+    bool done() const
+    {
+        return list == NULL;
+    }
+
+    SceneObject * operator*() const
+    {
+        return (*list)[index];
+    }
+
+    void next()
+    {
+        index++;
+        if (index >= list->size())
+            next_list();
+    }
+
+    void next_list()
+    {
+        index = 0;
+        while (++type_index < group.count) {
+            list = &scene->get_instances(group.types[type_index]);
+            if (!list->empty())
+                return;
+        }
+        list = NULL;
+    }
+};
+
+#include "movement.h"
 
-int randrange(int range)
+inline int randrange(int range)
 {
     return (rand() * range) / RAND_MAX;
 }
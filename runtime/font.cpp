@@ -1,5 +1,7 @@
 #include "font.h"
 
+FTCleanup * FTCleanup::_instance = 0;
+
 // FTLibrary
 
 const FTLibrary&  FTLibrary::Instance()
@@ -146,12 +148,122 @@ float FTSize::Underline() const
     return 0.0f;
 }
 
+// FTKerningCache
+
+FTKerningCache::FTKerningCache()
+:   entries(0),
+    capacity(0),
+    count(0)
+{
+}
+
+
+FTKerningCache::~FTKerningCache()
+{
+    delete[] entries;
+}
+
+
+bool FTKerningCache::Find(unsigned int index1, unsigned int index2,
+                          float& x, float& y) const
+{
+    if(!count)
+    {
+        return false;
+    }
+
+    unsigned int mask = capacity - 1;
+    unsigned int i = Hash(index1, index2) & mask;
+
+    // index1 == 0 marks an empty slot, glyph 0 is never kerned
+    while(entries[i].index1)
+    {
+        if(entries[i].index1 == index1 && entries[i].index2 == index2)
+        {
+            x = entries[i].x;
+            y = entries[i].y;
+            return true;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return false;
+}
+
+
+void FTKerningCache::Insert(unsigned int index1, unsigned int index2,
+                            float x, float y)
+{
+    if(!index1)
+    {
+        return;
+    }
+
+    // keep the load factor at or below 1/2
+    if((count + 1) * 2 > capacity)
+    {
+        Grow();
+    }
+
+    unsigned int mask = capacity - 1;
+    unsigned int i = Hash(index1, index2) & mask;
+
+    while(entries[i].index1)
+    {
+        if(entries[i].index1 == index1 && entries[i].index2 == index2)
+        {
+            entries[i].x = x;
+            entries[i].y = y;
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+
+    entries[i].index1 = index1;
+    entries[i].index2 = index2;
+    entries[i].x = x;
+    entries[i].y = y;
+    count++;
+}
+
+
+void FTKerningCache::Clear()
+{
+    delete[] entries;
+    entries = 0;
+    capacity = 0;
+    count = 0;
+}
+
+
+void FTKerningCache::Grow()
+{
+    Entry* oldEntries = entries;
+    unsigned int oldCapacity = capacity;
+
+    capacity = capacity ? capacity * 2 : INITIAL_CAPACITY;
+    entries = new Entry[capacity];
+    memset(entries, 0, capacity * sizeof(Entry));
+    count = 0;
+
+    for(unsigned int i = 0; i < oldCapacity; i++)
+    {
+        if(oldEntries[i].index1)
+        {
+            Insert(oldEntries[i].index1, oldEntries[i].index2,
+                   oldEntries[i].x, oldEntries[i].y);
+        }
+    }
+
+    delete[] oldEntries;
+}
+
 // FTFace
 
 FTFace::FTFace(const char* fontFilePath, bool precomputeKerning)
 :   numGlyphs(0),
     fontEncodingList(0),
-    kerningCache(0),
+    kerningComplete(false),
     err(0)
 {
     const FT_Long DEFAULT_FACE_INDEX = 0;
@@ -182,7 +294,7 @@ FTFace::FTFace(const unsigned char *pBufferBytes, size_t bufferSizeInBytes,
                bool precomputeKerning)
 :   numGlyphs(0),
     fontEncodingList(0),
-    kerningCache(0),
+    kerningComplete(false),
     err(0)
 {
     const FT_Long DEFAULT_FACE_INDEX = 0;
@@ -212,8 +324,6 @@ FTFace::FTFace(const unsigned char *pBufferBytes, size_t bufferSizeInBytes,
 
 FTFace::~FTFace()
 {
-    delete[] kerningCache;
-
     if(ftFace)
     {
         FTCleanup::Instance()->UnregisterObject(&ftFace);
@@ -278,35 +388,44 @@ FT_Encoding* FTFace::CharMapList()
 
 FTPoint FTFace::KernAdvance(unsigned int index1, unsigned int index2)
 {
-    FTGL_DOUBLE x, y;
-
     if(!hasKerningTable || !index1 || !index2)
     {
         return FTPoint(0.0, 0.0);
     }
 
-    if(kerningCache && index1 < FTFace::MAX_PRECOMPUTED
-        && index2 < FTFace::MAX_PRECOMPUTED)
+    float x, y;
+
+    if(!kerningCache.Find(index1, index2, x, y))
     {
-        x = kerningCache[2 * (index2 * FTFace::MAX_PRECOMPUTED + index1)];
-        y = kerningCache[2 * (index2 * FTFace::MAX_PRECOMPUTED + index1) + 1];
-        return FTPoint(x, y);
-    }
+        if(kerningComplete)
+        {
+            return FTPoint(0.0, 0.0);
+        }
 
-    FT_Vector kernAdvance;
-    kernAdvance.x = kernAdvance.y = 0;
+        FT_Vector kernAdvance;
+        kernAdvance.x = kernAdvance.y = 0;
 
-    err = FT_Get_Kerning(*ftFace, index1, index2, ft_kerning_unfitted,
-                         &kernAdvance);
-    if(err)
+        err = FT_Get_Kerning(*ftFace, index1, index2, FT_KERNING_UNSCALED,
+                             &kernAdvance);
+        if(err)
+        {
+            return FTPoint(0.0f, 0.0f);
+        }
+
+        x = static_cast<float>(kernAdvance.x);
+        y = static_cast<float>(kernAdvance.y);
+        kerningCache.Insert(index1, index2, x, y);
+    }
+
+    if(x == 0.0f && y == 0.0f)
     {
         return FTPoint(0.0f, 0.0f);
     }
 
-    x = static_cast<float>(kernAdvance.x) / 64.0f;
-    y = static_cast<float>(kernAdvance.y) / 64.0f;
-
-    return FTPoint(x, y);
+    // font units -> pixels at the current size (16.16 scale, 26.6 result)
+    const FT_Size_Metrics& metrics = (*ftFace)->size->metrics;
+    return FTPoint(x * (metrics.x_scale / 65536.0f) / 64.0f,
+                   y * (metrics.y_scale / 65536.0f) / 64.0f);
 }
 
 
@@ -322,32 +441,103 @@ FT_GlyphSlot FTFace::Glyph(unsigned int index, FT_Int load_flags)
 }
 
 
+static inline unsigned int ReadU16(const FT_Byte* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+
 void FTFace::BuildKerningCache()
 {
-    FT_Vector kernAdvance;
-    kernAdvance.x = 0;
-    kernAdvance.y = 0;
-    kerningCache = new FTGL_DOUBLE[FTFace::MAX_PRECOMPUTED
-                                    * FTFace::MAX_PRECOMPUTED * 2];
-    for(unsigned int j = 0; j < FTFace::MAX_PRECOMPUTED; j++)
+    // Read the pairs straight out of the TrueType 'kern' table once, so
+    // kerning for any glyph in the font is a single hash probe. Fonts
+    // without a table we understand fall back to filling the cache lazily
+    // from FT_Get_Kerning.
+    FT_ULong length = 0;
+    if(FT_Load_Sfnt_Table(*ftFace, TTAG_kern, 0, NULL, &length) || length < 4)
+    {
+        return;
+    }
+
+    FT_Byte* table = new FT_Byte[length];
+    if(FT_Load_Sfnt_Table(*ftFace, TTAG_kern, 0, table, &length))
     {
-        for(unsigned int i = 0; i < FTFace::MAX_PRECOMPUTED; i++)
+        delete[] table;
+        return;
+    }
+
+    // only the Microsoft version 0 layout, Apple's version 1 is left to
+    // FreeType
+    bool complete = ReadU16(table) == 0;
+    unsigned int tableCount = ReadU16(table + 2);
+    FT_ULong offset = 4;
+
+    for(unsigned int t = 0; complete && t < tableCount; t++)
+    {
+        if(offset + 6 > length)
+        {
+            complete = false;
+            break;
+        }
+
+        const FT_Byte* sub = table + offset;
+        unsigned int subLength = ReadU16(sub + 2);
+        unsigned int coverage = ReadU16(sub + 4);
+        offset += subLength;
+
+        bool horizontal = (coverage & 0x01) != 0;
+        bool minimum = (coverage & 0x02) != 0;
+        bool crossStream = (coverage & 0x04) != 0;
+        bool overrides = (coverage & 0x08) != 0;
+
+        if(!horizontal || minimum || crossStream)
+        {
+            continue;
+        }
+
+        if((coverage >> 8) != 0 || sub + 14 > table + length)
         {
-            err = FT_Get_Kerning(*ftFace, i, j, ft_kerning_unfitted,
-                                 &kernAdvance);
-            if(err)
+            // format 2 class tables etc.
+            complete = false;
+            break;
+        }
+
+        unsigned int pairCount = ReadU16(sub + 6);
+        const FT_Byte* pair = sub + 14;
+        // large tables overflow the 16-bit subtable length
+        offset = (sub - table) + 14 + pairCount * 6;
+        if(pair + pairCount * 6 > table + length)
+        {
+            complete = false;
+            break;
+        }
+
+        for(unsigned int i = 0; i < pairCount; i++, pair += 6)
+        {
+            unsigned int left = ReadU16(pair);
+            unsigned int right = ReadU16(pair + 2);
+            float value = static_cast<float>(
+                static_cast<FT_Short>(ReadU16(pair + 4)));
+
+            float x, y;
+            if(!overrides && kerningCache.Find(left, right, x, y))
             {
-                delete[] kerningCache;
-                kerningCache = NULL;
-                return;
+                value += x;
             }
-
-            kerningCache[2 * (j * FTFace::MAX_PRECOMPUTED + i)] =
-                                static_cast<FTGL_DOUBLE>(kernAdvance.x) / 64.0;
-            kerningCache[2 * (j * FTFace::MAX_PRECOMPUTED + i) + 1] =
-                                static_cast<FTGL_DOUBLE>(kernAdvance.y) / 64.0;
+            kerningCache.Insert(left, right, value, 0.0f);
         }
     }
+
+    delete[] table;
+
+    if(complete)
+    {
+        kerningComplete = true;
+    }
+    else
+    {
+        kerningCache.Clear();
+    }
 }
 
 FTFont::FTFont(char const *fontFilePath) :
@@ -653,208 +843,6 @@ FT_Error FTGlyph::Error() const
     return err;
 }
 
-// FTTextureFont
-
-static inline GLuint ClampSize(GLuint in, GLuint maxTextureSize)
-{
-    // Find next power of two
-    --in;
-    in |= in >> 16;
-    in |= in >> 8;
-    in |= in >> 4;
-    in |= in >> 2;
-    in |= in >> 1;
-    ++in;
-
-    // Clamp to max texture size
-    return in < maxTextureSize ? in : maxTextureSize;
-}
-
-class FTTextureFont : public FTFont
-{
-public:
-    GLsizei maximumGLTextureSize;
-    GLsizei textureWidth;
-    GLsizei textureHeight;
-    FTVector<GLuint> textureIDList;
-    int glyphHeight;
-    int glyphWidth;
-    unsigned int padding;
-    unsigned int numGlyphs;
-    unsigned int remGlyphs;
-    int xOffset;
-    int yOffset;
-    bool stroke;
-
-    FTTextureFont(const char* fontFilePath, bool stroke)
-    :   FTFont(fontFilePath),
-        maximumGLTextureSize(0),
-        textureWidth(0),
-        textureHeight(0),
-        glyphHeight(0),
-        glyphWidth(0),
-        xOffset(0),
-        yOffset(0),
-        padding(3),
-        stroke(stroke)
-    {
-        load_flags = FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP;
-        remGlyphs = numGlyphs = face.GlyphCount();
-        if (stroke) {
-            padding += 4;
-        }
-    }
-
-
-    ~FTTextureFont()
-    {
-        if(textureIDList.size())
-        {
-            glDeleteTextures((GLsizei)textureIDList.size(),
-                             (const GLuint*)&textureIDList[0]);
-        }
-    }
-
-
-    FTGlyph* MakeGlyph(FT_GlyphSlot ftGlyph)
-    {
-        glyphHeight = static_cast<int>(charSize.Height() + 0.5f);
-        glyphWidth = static_cast<int>(charSize.Width() + 0.5f);
-
-        if(glyphHeight < 1) glyphHeight = 1;
-        if(glyphWidth < 1) glyphWidth = 1;
-
-        if(textureIDList.empty())
-        {
-            textureIDList.push_back(CreateTexture());
-            xOffset = yOffset = padding;
-        }
-
-        if(xOffset > (textureWidth - glyphWidth))
-        {
-            xOffset = padding;
-            yOffset += glyphHeight;
-
-            if(yOffset > (textureHeight - glyphHeight))
-            {
-                textureIDList.push_back(CreateTexture());
-                yOffset = padding;
-            }
-        }
-
-        FTTextureGlyph* tempGlyph = new FTTextureGlyph(ftGlyph, textureIDList[textureIDList.size() - 1],
-                                                       xOffset, yOffset, textureWidth, textureHeight,
-                                                       stroke);
-        xOffset += static_cast<int>(tempGlyph->BBox().Upper().X() - tempGlyph->BBox().Lower().X() + padding + 0.5);
-
-        --remGlyphs;
-
-        return tempGlyph;
-    }
-
-
-    void CalculateTextureSize()
-    {
-        if(!maximumGLTextureSize)
-        {
-            maximumGLTextureSize = 1024;
-            glGetIntegerv(GL_MAX_TEXTURE_SIZE, (GLint*)&maximumGLTextureSize);
-            assert(maximumGLTextureSize); // Indicates an invalid OpenGL context
-        }
-
-        // Texture width required for numGlyphs glyphs. Will probably not be
-        // large enough, but we try to fit as many glyphs in one line as possible
-        textureWidth = ClampSize(glyphWidth * numGlyphs + padding * 2,
-                                 maximumGLTextureSize);
-
-        // Number of lines required for that many glyphs in a line
-        int tmp = (textureWidth - (padding * 2)) / glyphWidth;
-        tmp = tmp > 0 ? tmp : 1;
-        tmp = (numGlyphs + (tmp - 1)) / tmp; // round division up
-
-        // Texture height required for tmp lines of glyphs
-        textureHeight = ClampSize(glyphHeight * tmp + padding * 2,
-                                  maximumGLTextureSize);
-    }
-
-
-    GLuint CreateTexture()
-    {
-        CalculateTextureSize();
-
-        int totalMemory = textureWidth * textureHeight;
-        unsigned char* textureMemory = new unsigned char[totalMemory];
-        memset(textureMemory, 0, totalMemory);
-
-        GLuint textID;
-        glGenTextures(1, (GLuint*)&textID);
-
-        glBindTexture(GL_TEXTURE_2D, textID);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, textureWidth, textureHeight,
-                     0, GL_ALPHA, GL_UNSIGNED_BYTE, textureMemory);
-
-        delete [] textureMemory;
-
-        return textID;
-    }
-
-
-    bool FaceSize(const unsigned int size, const unsigned int res)
-    {
-        if(!textureIDList.empty())
-        {
-            glDeleteTextures((GLsizei)textureIDList.size(), (const GLuint*)&textureIDList[0]);
-            textureIDList.clear();
-            remGlyphs = numGlyphs = face.GlyphCount();
-        }
-
-        return FTFont::FaceSize(size, res);
-    }
-
-
-    template <typename T>
-    inline FTPoint RenderI(const T* string, const int len,
-                                          FTPoint position, FTPoint spacing,
-                                          int renderMode)
-    {
-        // Protect GL_TEXTURE_2D
-        glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_TEXTURE_ENV_MODE);
-
-        glEnable(GL_TEXTURE_2D);
-        glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
-
-        FTTextureGlyph::ResetActiveTexture();
-
-        FTPoint tmp = FTFont::Render(string, len,
-                                     position, spacing, renderMode);
-
-        glPopAttrib();
-
-        return tmp;
-    }
-
-
-    FTPoint Render(const char * string, const int len,
-                                      FTPoint position, FTPoint spacing,
-                                      int renderMode)
-    {
-        return RenderI(string, len, position, spacing, renderMode);
-    }
-
-
-    FTPoint Render(const wchar_t * string, const int len,
-                                      FTPoint position, FTPoint spacing,
-                                      int renderMode)
-    {
-        return RenderI(string, len, position, spacing, renderMode);
-    }
-};
-
 //
 //  FTTextureGlyph
 //
@@ -1045,6 +1033,14 @@ const FTGlyph* const FTGlyphContainer::Glyph(const unsigned int charCode) const
 }
 
 
+FTGlyph* FTGlyphContainer::Glyph(const unsigned int charCode)
+{
+    unsigned int index = charMap->GlyphListIndex(charCode);
+
+    return (index < glyphs.size()) ? glyphs[index] : NULL;
+}
+
+
 FTBBox FTGlyphContainer::BBox(const unsigned int charCode) const
 {
     return Glyph(charCode)->BBox();
@@ -1084,6 +1080,38 @@ FTPoint FTGlyphContainer::Render(const unsigned int charCode,
     return kernAdvance;
 }
 
+// FTCharToGlyphIndexMap
+
+unsigned int FTCharToGlyphIndexMap::AddPage(unsigned int page)
+{
+    if(pages[page] == NoPage)
+    {
+        unsigned int offset = static_cast<unsigned int>(fontIndices.size());
+        fontIndices.resize(offset + PageSize, 0);
+        listIndices.resize(offset + PageSize, 0);
+        pages[page] = offset;
+    }
+    return pages[page];
+}
+
+
+void FTCharToGlyphIndexMap::Build(FT_Face face)
+{
+    clear();
+
+    FT_UInt glyphIndex;
+    FT_ULong c = FT_Get_First_Char(face, &glyphIndex);
+    while(glyphIndex != 0)
+    {
+        if(c < UnicodeValLimit)
+        {
+            fontIndices[AddPage(c >> PageBits) + (c & PageMask)] = glyphIndex;
+        }
+        c = FT_Get_Next_Char(face, c, &glyphIndex);
+    }
+}
+
+
 // FTCharmap
 
 
@@ -1104,11 +1132,7 @@ FTCharmap::FTCharmap(FTFace* face)
     }
 
     ftEncoding = ftFace->charmap->encoding;
-
-    for(unsigned int i = 0; i < FTCharmap::MAX_PRECOMPUTED; i++)
-    {
-        charIndexCache[i] = FT_Get_Char_Index(ftFace, i);
-    }
+    charMap.Build(ftFace);
 }
 
 
@@ -1131,7 +1155,7 @@ bool FTCharmap::CharMap(FT_Encoding encoding)
     if(!err)
     {
         ftEncoding = encoding;
-        charMap.clear();
+        charMap.Build(ftFace);
     }
 
     return !err;
@@ -1146,9 +1170,9 @@ unsigned int FTCharmap::GlyphListIndex(const unsigned int characterCode)
 
 unsigned int FTCharmap::FontIndex(const unsigned int characterCode)
 {
-    if(characterCode < FTCharmap::MAX_PRECOMPUTED)
+    if(characterCode < FTCharToGlyphIndexMap::UnicodeValLimit)
     {
-        return charIndexCache[characterCode];
+        return charMap.FontIndex(characterCode);
     }
 
     return FT_Get_Char_Index(ftFace, characterCode);
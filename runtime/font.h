@@ -1,8 +1,12 @@
+#ifndef FONT_H
+#define FONT_H
+
 #include "include_gl.h"
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_GLYPH_H
 #include FT_TRUETYPE_TABLES_H
+#include FT_TRUETYPE_TAGS_H
 #include FT_OUTLINE_H
 #include FT_STROKER_H
 #include <set>
@@ -476,6 +480,47 @@ class FTSize
         FT_Error err;
 };
 
+// Sparse kerning cache keyed on glyph index pairs. Values are stored in
+// unscaled font units so the cache stays valid across FaceSize() changes.
+
+class FTKerningCache
+{
+    public:
+        FTKerningCache();
+        ~FTKerningCache();
+        bool Find(unsigned int index1, unsigned int index2, float& x,
+                  float& y) const;
+        void Insert(unsigned int index1, unsigned int index2, float x,
+                    float y);
+        void Clear();
+        unsigned int Count() const { return count; }
+
+    private:
+        struct Entry
+        {
+            unsigned int index1, index2;
+            float x, y;
+        };
+
+        static inline unsigned int Hash(unsigned int index1,
+                                        unsigned int index2)
+        {
+            unsigned int h = index1 * 0x9E3779B1u ^ index2;
+            h ^= h >> 15;
+            h *= 0x85EBCA6Bu;
+            return h ^ (h >> 13);
+        }
+
+        void Grow();
+        FTKerningCache(const FTKerningCache&);
+        FTKerningCache& operator=(const FTKerningCache&);
+
+        static const unsigned int INITIAL_CAPACITY = 256;
+        Entry* entries;
+        unsigned int capacity;
+        unsigned int count;
+};
+
 class FTFace
 {
     public:
@@ -502,8 +547,10 @@ class FTFace
         FT_Encoding* fontEncodingList;
         bool hasKerningTable;
         void BuildKerningCache();
-        static const unsigned int MAX_PRECOMPUTED = 128;
-        FTGL_DOUBLE* kerningCache;
+        FTKerningCache kerningCache;
+        // true when the whole kern table went into the cache, so a miss
+        // means the pair has no kerning
+        bool kerningComplete;
         FT_Error err;
 };
 
@@ -522,97 +569,81 @@ class FTGlyph
         FT_Error err;
 };
 
+// Flat two-level charmap, built once from the face when the charmap is
+// selected. The page table maps the upper bits of a character code to a
+// 256-entry block, so both lookups are two loads with no allocation on
+// the render path.
+
 class FTCharToGlyphIndexMap
 {
     public:
-        typedef unsigned long CharacterCode;
-        typedef signed long GlyphIndex;
+        typedef unsigned int CharacterCode;
+        typedef unsigned int GlyphIndex;
 
-        // XXX: always ensure that 1 << (3 * BucketIdxBits) >= UnicodeValLimit
-        static const int BucketIdxBits = 7;
-        static const int BucketIdxSize = 1 << BucketIdxBits;
-        static const int BucketIdxMask = BucketIdxSize - 1;
+        static const int PageBits = 8;
+        static const unsigned int PageSize = 1 << PageBits;
+        static const unsigned int PageMask = PageSize - 1;
 
         static const CharacterCode UnicodeValLimit = 0x110000;
-        static const int IndexNotFound = -1;
+        static const unsigned int PageCount = UnicodeValLimit >> PageBits;
+        static const unsigned int NoPage = 0xFFFFFFFF;
 
         FTCharToGlyphIndexMap()
         {
-            Indices = 0;
+            ResetPages();
         }
 
-        virtual ~FTCharToGlyphIndexMap()
-        {
-            // Free all buckets
-            clear();
-        }
+        void Build(FT_Face face);
 
         inline void clear()
         {
-            for(int j = 0; Indices && j < BucketIdxSize; j++)
-            {
-                for(int i = 0; Indices[j] && i < BucketIdxSize; i++)
-                {
-                    delete[] Indices[j][i];
-                    Indices[j][i] = 0;
-                }
-                delete[] Indices[j];
-                Indices[j] = 0;
-            }
-            delete[] Indices;
-            Indices = 0;
+            ResetPages();
+            fontIndices.clear();
+            listIndices.clear();
         }
 
-        const GlyphIndex find(CharacterCode c)
+        inline GlyphIndex FontIndex(CharacterCode c) const
         {
-            int OuterIdx = (c >> (BucketIdxBits * 2)) & BucketIdxMask;
-            int InnerIdx = (c >> BucketIdxBits) & BucketIdxMask;
-            int Offset = c & BucketIdxMask;
-
-            if (c >= UnicodeValLimit || !Indices
-                 || !Indices[OuterIdx] || !Indices[OuterIdx][InnerIdx])
+            if(c >= UnicodeValLimit)
                 return 0;
+            unsigned int page = pages[c >> PageBits];
+            if(page == NoPage)
+                return 0;
+            return fontIndices[page + (c & PageMask)];
+        }
 
-            GlyphIndex g = Indices[OuterIdx][InnerIdx][Offset];
-
-            return (g != IndexNotFound) ? g : 0;
+        inline GlyphIndex find(CharacterCode c) const
+        {
+            if(c >= UnicodeValLimit)
+                return 0;
+            unsigned int page = pages[c >> PageBits];
+            if(page == NoPage)
+                return 0;
+            return listIndices[page + (c & PageMask)];
         }
 
         void insert(CharacterCode c, GlyphIndex g)
         {
-            int OuterIdx = (c >> (BucketIdxBits * 2)) & BucketIdxMask;
-            int InnerIdx = (c >> BucketIdxBits) & BucketIdxMask;
-            int Offset = c & BucketIdxMask;
-
-            if (c >= UnicodeValLimit)
+            if(c >= UnicodeValLimit)
                 return;
-
-            if (!Indices)
-            {
-                Indices = new GlyphIndex** [BucketIdxSize];
-                for(int i = 0; i < BucketIdxSize; i++)
-                    Indices[i] = 0;
-            }
-
-            if (!Indices[OuterIdx])
-            {
-                Indices[OuterIdx] = new GlyphIndex* [BucketIdxSize];
-                for(int i = 0; i < BucketIdxSize; i++)
-                    Indices[OuterIdx][i] = 0;
-            }
-
-            if (!Indices[OuterIdx][InnerIdx])
-            {
-                Indices[OuterIdx][InnerIdx] = new GlyphIndex [BucketIdxSize];
-                for(int i = 0; i < BucketIdxSize; i++)
-                    Indices[OuterIdx][InnerIdx][i] = IndexNotFound;
-            }
-
-            Indices[OuterIdx][InnerIdx][Offset] = g;
+            // characters missing from the font still get a slot for the
+            // .notdef glyph
+            listIndices[AddPage(c >> PageBits) + (c & PageMask)] = g;
         }
 
     private:
-        GlyphIndex*** Indices;
+        void ResetPages()
+        {
+            for(unsigned int i = 0; i < PageCount; i++)
+                pages[i] = NoPage;
+        }
+
+        unsigned int AddPage(unsigned int page);
+
+        // offset into the blocks for each page, or NoPage
+        unsigned int pages[PageCount];
+        FTVector<GlyphIndex> fontIndices;
+        FTVector<GlyphIndex> listIndices;
 };
 
 class FTCharmap
@@ -633,8 +664,6 @@ class FTCharmap
         const FT_Face ftFace;
         typedef FTCharToGlyphIndexMap CharacterMap;
         CharacterMap charMap;
-        static const unsigned int MAX_PRECOMPUTED = 128;
-        unsigned int charIndexCache[MAX_PRECOMPUTED];
         FT_Error err;
 };
 
@@ -648,6 +677,7 @@ class FTGlyphContainer
         unsigned int FontIndex(const unsigned int characterCode) const;
         void Add(FTGlyph* glyph, const unsigned int characterCode);
         const FTGlyph* const Glyph(const unsigned int characterCode) const;
+        FTGlyph* Glyph(const unsigned int characterCode);
         FTBBox BBox(const unsigned int characterCode) const;
         float Advance(const unsigned int characterCode,
                       const unsigned int nextCharacterCode);
@@ -721,7 +751,7 @@ class FTCleanup
     protected:
         static FTCleanup* _instance;
 
-        FTCleanup::FTCleanup()
+        FTCleanup()
         {
         }
 
@@ -775,8 +805,6 @@ class FTCleanup
         std::set<FT_Face **> cleanupFT_FaceItems;
 };
 
-FTCleanup * FTCleanup::_instance = 0;
-
 class FTTextureGlyph : public FTGlyph
 {
     public:
@@ -1083,4 +1111,208 @@ inline void FTUnicodeStringItr<T>::readUTF16()
         }
     }
     curChar = ch;
-}
\ No newline at end of file
+}
+
+// FTTextureFont
+
+static inline GLuint ClampSize(GLuint in, GLuint maxTextureSize)
+{
+    // Find next power of two
+    --in;
+    in |= in >> 16;
+    in |= in >> 8;
+    in |= in >> 4;
+    in |= in >> 2;
+    in |= in >> 1;
+    ++in;
+
+    // Clamp to max texture size
+    return in < maxTextureSize ? in : maxTextureSize;
+}
+
+class FTTextureFont : public FTFont
+{
+public:
+    GLsizei maximumGLTextureSize;
+    GLsizei textureWidth;
+    GLsizei textureHeight;
+    FTVector<GLuint> textureIDList;
+    int glyphHeight;
+    int glyphWidth;
+    unsigned int padding;
+    unsigned int numGlyphs;
+    unsigned int remGlyphs;
+    int xOffset;
+    int yOffset;
+    bool stroke;
+
+    FTTextureFont(const char* fontFilePath, bool stroke)
+    :   FTFont(fontFilePath),
+        maximumGLTextureSize(0),
+        textureWidth(0),
+        textureHeight(0),
+        glyphHeight(0),
+        glyphWidth(0),
+        xOffset(0),
+        yOffset(0),
+        padding(3),
+        stroke(stroke)
+    {
+        load_flags = FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP;
+        remGlyphs = numGlyphs = face.GlyphCount();
+        if (stroke) {
+            padding += 4;
+        }
+    }
+
+
+    ~FTTextureFont()
+    {
+        if(textureIDList.size())
+        {
+            glDeleteTextures((GLsizei)textureIDList.size(),
+                             (const GLuint*)&textureIDList[0]);
+        }
+    }
+
+
+    FTGlyph* MakeGlyph(FT_GlyphSlot ftGlyph)
+    {
+        glyphHeight = static_cast<int>(charSize.Height() + 0.5f);
+        glyphWidth = static_cast<int>(charSize.Width() + 0.5f);
+
+        if(glyphHeight < 1) glyphHeight = 1;
+        if(glyphWidth < 1) glyphWidth = 1;
+
+        if(textureIDList.empty())
+        {
+            textureIDList.push_back(CreateTexture());
+            xOffset = yOffset = padding;
+        }
+
+        if(xOffset > (textureWidth - glyphWidth))
+        {
+            xOffset = padding;
+            yOffset += glyphHeight;
+
+            if(yOffset > (textureHeight - glyphHeight))
+            {
+                textureIDList.push_back(CreateTexture());
+                yOffset = padding;
+            }
+        }
+
+        FTTextureGlyph* tempGlyph = new FTTextureGlyph(ftGlyph, textureIDList[textureIDList.size() - 1],
+                                                       xOffset, yOffset, textureWidth, textureHeight,
+                                                       stroke);
+        xOffset += static_cast<int>(tempGlyph->BBox().Upper().X() - tempGlyph->BBox().Lower().X() + padding + 0.5);
+
+        --remGlyphs;
+
+        return tempGlyph;
+    }
+
+
+    void CalculateTextureSize()
+    {
+        if(!maximumGLTextureSize)
+        {
+            maximumGLTextureSize = 1024;
+            glGetIntegerv(GL_MAX_TEXTURE_SIZE, (GLint*)&maximumGLTextureSize);
+            assert(maximumGLTextureSize); // Indicates an invalid OpenGL context
+        }
+
+        // Texture width required for numGlyphs glyphs. Will probably not be
+        // large enough, but we try to fit as many glyphs in one line as possible
+        textureWidth = ClampSize(glyphWidth * numGlyphs + padding * 2,
+                                 maximumGLTextureSize);
+
+        // Number of lines required for that many glyphs in a line
+        int tmp = (textureWidth - (padding * 2)) / glyphWidth;
+        tmp = tmp > 0 ? tmp : 1;
+        tmp = (numGlyphs + (tmp - 1)) / tmp; // round division up
+
+        // Texture height required for tmp lines of glyphs
+        textureHeight = ClampSize(glyphHeight * tmp + padding * 2,
+                                  maximumGLTextureSize);
+    }
+
+
+    GLuint CreateTexture()
+    {
+        CalculateTextureSize();
+
+        int totalMemory = textureWidth * textureHeight;
+        unsigned char* textureMemory = new unsigned char[totalMemory];
+        memset(textureMemory, 0, totalMemory);
+
+        GLuint textID;
+        glGenTextures(1, (GLuint*)&textID);
+
+        glBindTexture(GL_TEXTURE_2D, textID);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, textureWidth, textureHeight,
+                     0, GL_ALPHA, GL_UNSIGNED_BYTE, textureMemory);
+
+        delete [] textureMemory;
+
+        return textID;
+    }
+
+
+    bool FaceSize(const unsigned int size, const unsigned int res)
+    {
+        if(!textureIDList.empty())
+        {
+            glDeleteTextures((GLsizei)textureIDList.size(), (const GLuint*)&textureIDList[0]);
+            textureIDList.clear();
+            remGlyphs = numGlyphs = face.GlyphCount();
+        }
+
+        return FTFont::FaceSize(size, res);
+    }
+
+
+    template <typename T>
+    inline FTPoint RenderI(const T* string, const int len,
+                                          FTPoint position, FTPoint spacing,
+                                          int renderMode)
+    {
+        // Protect GL_TEXTURE_2D
+        glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_TEXTURE_ENV_MODE);
+
+        glEnable(GL_TEXTURE_2D);
+        glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+
+        FTTextureGlyph::ResetActiveTexture();
+
+        FTPoint tmp = FTFont::Render(string, len,
+                                     position, spacing, renderMode);
+
+        glPopAttrib();
+
+        return tmp;
+    }
+
+
+    FTPoint Render(const char * string, const int len,
+                                      FTPoint position, FTPoint spacing,
+                                      int renderMode)
+    {
+        return RenderI(string, len, position, spacing, renderMode);
+    }
+
+
+    FTPoint Render(const wchar_t * string, const int len,
+                                      FTPoint position, FTPoint spacing,
+                                      int renderMode)
+    {
+        return RenderI(string, len, position, spacing, renderMode);
+    }
+};
+
+#endif // FONT_H
@@ -0,0 +1,14 @@
+// Copyright (c) Mathias Kaerlev
+// See LICENSE for details.
+
+#ifndef INCLUDE_GL_H
+#define INCLUDE_GL_H
+
+#include <GL/glfw.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <wctype.h>
+
+#endif // INCLUDE_GL_H
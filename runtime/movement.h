@@ -0,0 +1,214 @@
+// Copyright (c) Mathias Kaerlev
+// See LICENSE for details.
+
+#ifndef MOVEMENT_H
+#define MOVEMENT_H
+
+// Built-in movements. The builder writes a constant MovementInfo per object
+// type and points SceneObject::movement at it. Scene::add_object() hands
+// such objects to the scene's MovementController, which moves all of them
+// in one pass per tick grouped by movement kind.
+
+struct BallMovement
+{
+    SceneObject * object;
+    float vx, vy;
+    bool bounce;
+};
+
+struct EightDirectionMovement
+{
+    SceneObject * object;
+    float speed;
+};
+
+struct PathMovement
+{
+    SceneObject * object;
+    const MovementInfo * info;
+    float origin_x, origin_y;
+    int node;
+    float distance; // travelled along the current segment
+    bool done;
+};
+
+class MovementController : public Controller
+{
+public:
+    Scene * scene;
+    std::vector<BallMovement> balls;
+    std::vector<EightDirectionMovement> eight_directions;
+    std::vector<PathMovement> paths;
+
+    MovementController(Scene * scene)
+    : scene(scene)
+    {
+    }
+
+    void add(SceneObject * object)
+    {
+        const MovementInfo * info = object->movement;
+        switch (info->type) {
+            case MOVEMENT_BALL: {
+                BallMovement ball;
+                ball.object = object;
+                float sin_value, cos_value;
+                get_sin_cos(info->angle, sin_value, cos_value);
+                ball.vx = cos_value * info->speed;
+                ball.vy = -sin_value * info->speed;
+                ball.bounce = info->bounce;
+                balls.push_back(ball);
+                break;
+            }
+            case MOVEMENT_EIGHT_DIRECTIONS: {
+                EightDirectionMovement item;
+                item.object = object;
+                item.speed = info->speed;
+                eight_directions.push_back(item);
+                break;
+            }
+            case MOVEMENT_PATH: {
+                if (info->node_count == 0)
+                    break;
+                PathMovement path;
+                path.object = object;
+                path.info = info;
+                path.origin_x = (float)object->x;
+                path.origin_y = (float)object->y;
+                path.node = 0;
+                path.distance = 0.0f;
+                path.done = false;
+                paths.push_back(path);
+                break;
+            }
+        }
+    }
+
+    void update(float dt)
+    {
+        update_balls(dt);
+        update_eight_directions(dt);
+        update_paths(dt);
+    }
+
+    void update_balls(float dt)
+    {
+        float width = (float)scene->width;
+        float height = (float)scene->height;
+        for (std::vector<BallMovement>::iterator it = balls.begin();
+             it != balls.end(); it++) {
+            SceneObject * object = it->object;
+            float x = (float)object->x + it->vx * dt;
+            float y = (float)object->y + it->vy * dt;
+            if (it->bounce) {
+                if ((x < 0.0f && it->vx < 0.0f) ||
+                    (x > width && it->vx > 0.0f))
+                    it->vx = -it->vx;
+                if ((y < 0.0f && it->vy < 0.0f) ||
+                    (y > height && it->vy > 0.0f))
+                    it->vy = -it->vy;
+            }
+            object->set_position(x, y);
+        }
+    }
+
+    void update_eight_directions(float dt)
+    {
+        if (eight_directions.empty())
+            return;
+        // the keyboard is read once for every object using the movement
+        float dx = 0.0f, dy = 0.0f;
+        if (is_key_down(GLFW_KEY_LEFT))
+            dx -= 1.0f;
+        if (is_key_down(GLFW_KEY_RIGHT))
+            dx += 1.0f;
+        if (is_key_down(GLFW_KEY_UP))
+            dy -= 1.0f;
+        if (is_key_down(GLFW_KEY_DOWN))
+            dy += 1.0f;
+        if (dx == 0.0f && dy == 0.0f)
+            return;
+        if (dx != 0.0f && dy != 0.0f) {
+            dx *= 0.70710678f;
+            dy *= 0.70710678f;
+        }
+        dx *= dt;
+        dy *= dt;
+        for (std::vector<EightDirectionMovement>::iterator it =
+             eight_directions.begin(); it != eight_directions.end(); it++) {
+            SceneObject * object = it->object;
+            object->set_position(object->x + dx * it->speed,
+                                 object->y + dy * it->speed);
+        }
+    }
+
+    void update_paths(float dt)
+    {
+        for (std::vector<PathMovement>::iterator it = paths.begin();
+             it != paths.end(); it++) {
+            if (it->done)
+                continue;
+            const MovementInfo * info = it->info;
+            float step = info->speed * dt;
+            if (step <= 0.0f)
+                continue;
+            float from_x = 0.0f, from_y = 0.0f;
+            if (it->node > 0) {
+                from_x = info->nodes[it->node - 1].x;
+                from_y = info->nodes[it->node - 1].y;
+            }
+            float x = from_x, y = from_y;
+            while (step > 0.0f) {
+                const PathNode & to = info->nodes[it->node];
+                float seg_x = to.x - from_x;
+                float seg_y = to.y - from_y;
+                float length = sqrt(seg_x * seg_x + seg_y * seg_y);
+                float left = length - it->distance;
+                if (step < left) {
+                    it->distance += step;
+                    float t = length > 0.0f ? it->distance / length : 1.0f;
+                    x = from_x + seg_x * t;
+                    y = from_y + seg_y * t;
+                    break;
+                }
+                step -= left;
+                x = from_x = to.x;
+                y = from_y = to.y;
+                it->distance = 0.0f;
+                it->node++;
+                if (it->node < info->node_count)
+                    continue;
+                if (!info->loop || info->path_length <= 0.0f) {
+                    it->done = true;
+                    break;
+                }
+                step = fmod(step, info->path_length);
+                // nodes are relative to where the path started, so a
+                // looping path continues from its end point
+                it->origin_x += x;
+                it->origin_y += y;
+                x = y = from_x = from_y = 0.0f;
+                it->node = 0;
+            }
+            it->object->set_position(it->origin_x + x, it->origin_y + y);
+        }
+    }
+};
+
+// defined in run.cpp
+extern char movement_controller_key;
+
+inline void add_movement(Scene * scene, SceneObject * object)
+{
+    // one controller per scene
+    const void * key = &movement_controller_key;
+    MovementController * controller =
+        (MovementController*)scene->get_controller(key);
+    if (controller == NULL) {
+        controller = new MovementController(scene);
+        scene->add_controller(key, controller);
+    }
+    controller->add(object);
+}
+
+#endif // MOVEMENT_H
@@ -0,0 +1,24 @@
+// Copyright (c) Mathias Kaerlev
+// See LICENSE for details.
+
+#ifndef PCH_H
+#define PCH_H
+
+// Library and standard headers that every translation unit needs and that
+// never change between builds. CMakeLists.txt compiles this once as a
+// precompiled header when CHOWDREN_PCH is on.
+
+#include "SOIL.h"
+#include <string>
+#include <list>
+#include <vector>
+#include <map>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <GL/glfw.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#endif /* PCH_H */
@@ -0,0 +1,137 @@
+// Copyright (c) Mathias Kaerlev
+// See LICENSE for details.
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// Input recording. With -record <file> the runtime writes the random seed
+// and, for every frame, the time step and the key events that arrived since
+// the previous frame. With -playback <file> those replace the clock and the
+// keyboard and the game quits when the recording ends, so a session plays
+// back identically. The profile-guided build uses this for its training run.
+
+#define RECORD_MAGIC "CHRC"
+#define RECORD_VERSION 1
+
+struct KeyEvent
+{
+    int key, action;
+};
+
+class InputRecorder
+{
+public:
+    enum Mode
+    {
+        NONE,
+        RECORD,
+        PLAYBACK
+    };
+
+    Mode mode;
+    FILE * fp;
+    std::vector<KeyEvent> events;
+
+    InputRecorder()
+    : mode(NONE), fp(NULL)
+    {
+    }
+
+    ~InputRecorder()
+    {
+        if (fp != NULL)
+            fclose(fp);
+    }
+
+    bool record(const char * filename, unsigned int seed)
+    {
+        fp = fopen(filename, "wb");
+        if (fp == NULL)
+            return false;
+        mode = RECORD;
+        fwrite(RECORD_MAGIC, 4, 1, fp);
+        write_int(RECORD_VERSION);
+        write_int((int)seed);
+        return true;
+    }
+
+    bool playback(const char * filename, unsigned int & seed)
+    {
+        fp = fopen(filename, "rb");
+        if (fp == NULL)
+            return false;
+        char magic[4];
+        int version, value;
+        if (fread(magic, 4, 1, fp) != 1 ||
+            memcmp(magic, RECORD_MAGIC, 4) != 0 ||
+            !read_int(version) || version != RECORD_VERSION ||
+            !read_int(value)) {
+            fclose(fp);
+            fp = NULL;
+            return false;
+        }
+        seed = (unsigned int)value;
+        mode = PLAYBACK;
+        return true;
+    }
+
+    bool is_playing()
+    {
+        return mode == PLAYBACK;
+    }
+
+    void add_event(int key, int action)
+    {
+        if (mode != RECORD)
+            return;
+        KeyEvent event = {key, action};
+        events.push_back(event);
+    }
+
+    void write_frame(double dt)
+    {
+        if (mode != RECORD)
+            return;
+        fwrite(&dt, sizeof(double), 1, fp);
+        write_int((int)events.size());
+        for (std::vector<KeyEvent>::const_iterator it = events.begin();
+             it != events.end(); it++) {
+            write_int(it->key);
+            write_int(it->action);
+        }
+        events.clear();
+    }
+
+    // false at the end of the recording
+    bool read_frame(double & dt)
+    {
+        events.clear();
+        int count;
+        if (fread(&dt, sizeof(double), 1, fp) != 1 || !read_int(count))
+            return false;
+        for (int i = 0; i < count; i++) {
+            KeyEvent event;
+            if (!read_int(event.key) || !read_int(event.action))
+                return false;
+            events.push_back(event);
+        }
+        return true;
+    }
+
+private:
+    void write_int(int value)
+    {
+        fwrite(&value, sizeof(int), 1, fp);
+    }
+
+    bool read_int(int & value)
+    {
+        return fread(&value, sizeof(int), 1, fp) == 1;
+    }
+};
+
+#endif // RECORD_H
@@ -10,14 +10,18 @@ class GameManager;
 #include <GL/glfw.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include "config.h"
 #include "common.h"
-#include "images.h"
+#include "record.h"
 
-#ifndef NDEBUG
-#define DEBUG
-#endif
+// CHOWDREN_DEBUG is defined for Debug builds by CMakeLists.txt
+
+// runtime globals declared in common.h and movement.h
+SinCosTable sin_cos_table;
+char movement_controller_key;
+unsigned char key_states[GLFW_KEY_LAST + 1];
 
 #define FRAMERATE 85.0
 
@@ -28,7 +32,7 @@ public:
 
     GameManager() : scene(NULL)
     {
-    #ifdef DEBUG
+    #ifdef CHOWDREN_DEBUG
         glfwOpenWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE);
     #endif
         glfwOpenWindowHint(GLFW_FSAA_SAMPLES, 0);
@@ -63,33 +67,86 @@ public:
             scene->on_end();
         scene = get_scenes(this)[index];
         scene->on_start();
+        scene->push_trigger(TRIGGER_START_OF_SCENE);
     }
 };
 
-#if 1 /* defined(DEBUG) || !defined(_WIN32) */
+static GameManager * global_manager = NULL;
+static InputRecorder recorder;
+
+static void handle_key(int key, int action)
+{
+    if (key >= 0 && key <= GLFW_KEY_LAST)
+        key_states[key] = action == GLFW_PRESS;
+    Scene * scene = global_manager->scene;
+    if (action == GLFW_PRESS)
+        scene->push_trigger(TRIGGER_KEY_PRESSED, key);
+    else
+        scene->push_trigger(TRIGGER_KEY_RELEASED, key);
+}
+
+void GLFWCALL on_key(int key, int action)
+{
+    // the keyboard is ignored while a recording plays back
+    if (recorder.is_playing())
+        return;
+    recorder.add_event(key, action);
+    handle_key(key, action);
+}
+
+#if 1 /* defined(CHOWDREN_DEBUG) || !defined(_WIN32) */
 int main (int argc, char *argv[])
 #else
 int WINAPI WinMain(HINSTANCE inst, HINSTANCE prev, LPSTR cmd, int show)
 #endif
 {
+    unsigned int seed = (unsigned int)time(NULL);
+    for (int i = 1; i + 1 < argc; i++) {
+        const char * filename = argv[i + 1];
+        if (strcmp(argv[i], "-record") == 0) {
+            if (!recorder.record(filename, seed)) {
+                printf("could not write %s\n", filename);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-playback") == 0) {
+            if (!recorder.playback(filename, seed)) {
+                printf("could not read %s\n", filename);
+                return 1;
+            }
+        }
+    }
+
     // setup random generator from start
-    srand((unsigned int)time(NULL));
+    srand(seed);
 
     glfwInit();
     GameManager manager = GameManager();
+    global_manager = &manager;
+    glfwSetKeyCallback(on_key);
 
     double current_time, old_time, dt, next_update;
     old_time = glfwGetTime();
 
     while(true) {
-        current_time = glfwGetTime();
-        dt = current_time - old_time;
-
-        if (dt <= 0.0)
-            continue;
-
-        old_time = current_time;
-        next_update = current_time + 1.0 / FRAMERATE;
+        if (recorder.is_playing()) {
+            // recorded time steps replace the clock, and frames run as fast
+            // as they can
+            if (!recorder.read_frame(dt))
+                break;
+            for (std::vector<KeyEvent>::const_iterator it =
+                 recorder.events.begin(); it != recorder.events.end(); it++)
+                handle_key(it->key, it->action);
+        } else {
+            current_time = glfwGetTime();
+            dt = current_time - old_time;
+
+            if (dt <= 0.0)
+                continue;
+
+            old_time = current_time;
+            next_update = current_time + 1.0 / FRAMERATE;
+            recorder.write_frame(dt);
+        }
 
         // printf("%f\n", 1.0 / dt);
         if (!manager.update(dt))
@@ -100,6 +157,9 @@ int WINAPI WinMain(HINSTANCE inst, HINSTANCE prev, LPSTR cmd, int show)
         if (!glfwGetWindowParam(GLFW_OPENED))
             break;
 
+        if (recorder.is_playing())
+            continue;
+
         dt = next_update - glfwGetTime();
         if (dt > 0.0) {
             glfwSleep(dt);